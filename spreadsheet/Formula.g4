@@ -9,10 +9,18 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
+        | FUNCTION '(' arg (',' arg)* ')'  # Call
         | CELL  # Cell
         | NUMBER  # Literal
         ;
 
+// The Call and arg rules have not been run through the ANTLR tool or built
+// against antlr4_runtime yet; check them together with ParseASTListener.
+arg
+        : CELL ':' CELL  # Range
+        | expr  # Argument
+        ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -27,4 +35,5 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+FUNCTION: 'SUM' | 'MIN' | 'MAX' | 'AVERAGE' | 'COUNT' ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
@@ -4,11 +4,18 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <new>
 #include <optional>
 #include <sstream>
+#include <utility>
 
 namespace ASTImpl {
 
@@ -40,238 +47,1084 @@ namespace ASTImpl {
              {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
-    class Expr {
-    public:
-        virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(std::function<double(Position)> get_cell_value) const = 0;
+    namespace {
+        struct FunctionName {
+            std::string_view name;
+            OpCode code;
+        };
+
+        constexpr FunctionName FUNCTIONS[] = {
+            {"SUM"sv, OpCode::Sum},
+            {"MIN"sv, OpCode::Min},
+            {"MAX"sv, OpCode::Max},
+            {"AVERAGE"sv, OpCode::Average},
+            {"COUNT"sv, OpCode::Count},
+        };
+
+        std::optional<OpCode> FindFunction(std::string_view name) {
+            for (const FunctionName& function : FUNCTIONS) {
+                if (function.name == name) return function.code;
+            }
+            return std::nullopt;
+        }
+
+        std::string_view GetFunctionName(OpCode code) {
+            for (const FunctionName& function : FUNCTIONS) {
+                if (function.code == code) return function.name;
+            }
+            assert(false);
+            return {};
+        }
+
+        bool IsFunction(OpCode code) {
+            return code >= OpCode::Sum && code <= OpCode::Count;
+        }
+
+        // Свёртки подряд лежащих значений. Четыре независимых аккумулятора
+        // не связаны зависимостью по данным, поэтому цикл раскладывается
+        // по SIMD-регистрам без -ffast-math.
+        double SumValues(const double* values, std::size_t count) {
+            double acc[4] = {0.0, 0.0, 0.0, 0.0};
+            std::size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                for (std::size_t lane = 0; lane < 4; ++lane) {
+                    acc[lane] += values[i + lane];
+                }
+            }
+            for (; i < count; ++i) {
+                acc[0] += values[i];
+            }
+            return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+        }
+
+        template <typename Less>
+        double ExtremeValue(const double* values, std::size_t count, double initial, Less less) {
+            double acc[4] = {initial, initial, initial, initial};
+            std::size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                for (std::size_t lane = 0; lane < 4; ++lane) {
+                    acc[lane] = less(values[i + lane], acc[lane]) ? values[i + lane] : acc[lane];
+                }
+            }
+            for (; i < count; ++i) {
+                acc[0] = less(values[i], acc[0]) ? values[i] : acc[0];
+            }
+            double result = acc[0];
+            for (std::size_t lane = 1; lane < 4; ++lane) {
+                result = less(acc[lane], result) ? acc[lane] : result;
+            }
+            return result;
+        }
 
-        virtual ExprPrecedence GetPrecedence() const = 0;
+        // Частичный итог функции: сумма, минимум или максимум значений.
+        // У пустого набора минимум равен +inf, максимум - -inf.
+        double Reduce(OpCode function, const double* values, std::size_t count) {
+            constexpr double INF = std::numeric_limits<double>::infinity();
+            switch (function) {
+                case OpCode::Min:
+                    return ExtremeValue(values, count, INF, std::less<double>{});
+                case OpCode::Max:
+                    return ExtremeValue(values, count, -INF, std::greater<double>{});
+                case OpCode::Count:
+                    return 0.0;
+                default:
+                    return SumValues(values, count);
+            }
+        }
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                          bool right_child = false) const {
-            auto precedence = GetPrecedence();
-            auto mask = right_child ? PR_RIGHT : PR_LEFT;
-            bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-            if (parens_needed) {
-                out << '(';
+        double Combine(OpCode function, double lhs, double rhs) {
+            switch (function) {
+                case OpCode::Min:
+                    return std::min(lhs, rhs);
+                case OpCode::Max:
+                    return std::max(lhs, rhs);
+                case OpCode::Count:
+                    return 0.0;
+                default:
+                    return lhs + rhs;
             }
+        }
 
-            DoPrintFormula(out, precedence);
+        double Apply(OpCode code, double lhs, double rhs) {
+            switch (code) {
+                case OpCode::Add:
+                    return lhs + rhs;
+                case OpCode::Subtract:
+                    return lhs - rhs;
+                case OpCode::Multiply:
+                    return lhs * rhs;
+                default:
+                    return lhs / rhs;
+            }
+        }
 
-            if (parens_needed) {
-                out << ')';
+        // lhs[k] = lhs[k] op rhs[k]. Выбор операции вынесен из цикла, чтобы
+        // каждый цикл был простым проходом по массивам и компилятор делал
+        // его векторным.
+        void ApplyColumns(OpCode code, double* lhs, const double* rhs, std::size_t count) {
+            switch (code) {
+                case OpCode::Add:
+                    for (std::size_t k = 0; k < count; ++k) lhs[k] += rhs[k];
+                    break;
+                case OpCode::Subtract:
+                    for (std::size_t k = 0; k < count; ++k) lhs[k] -= rhs[k];
+                    break;
+                case OpCode::Multiply:
+                    for (std::size_t k = 0; k < count; ++k) lhs[k] *= rhs[k];
+                    break;
+                default:
+                    for (std::size_t k = 0; k < count; ++k) lhs[k] /= rhs[k];
+                    break;
+            }
+        }
+
+        // Значение функции по частичному итогу всех аргументов и числу значений.
+        double Finish(OpCode function, double partial, double count) {
+            double result = partial;
+            switch (function) {
+                case OpCode::Min:
+                case OpCode::Max:
+                    result = count > 0 ? partial : 0.0;
+                    break;
+                case OpCode::Average:
+                    result = partial / count;
+                    break;
+                case OpCode::Count:
+                    result = count;
+                    break;
+                default:
+                    break;
+            }
+            if (!std::isfinite(result)) {
+                throw FormulaError(FormulaError::Category::Arithmetic);
             }
+            return result;
+        }
+    }  // namespace
+
+    struct Program::Header {
+        std::uint32_t node_count;
+        // Исполняемый код - отрезок массива узлов. Если свёртка констант
+        // ничего не изменила, это само дерево, иначе - узлы после дерева.
+        std::uint32_t code_begin;
+        std::uint32_t code_count;
+        std::uint32_t constant_count;
+        std::uint32_t cell_count;
+        std::uint32_t range_count;
+        // Наибольшая глубина стека при выполнении.
+        std::uint32_t max_depth;
+        // Размер блока вместе с заголовком.
+        std::uint32_t size;
+
+        // Таблицы лежат сразу за заголовком: числа, узлы, ячейки, диапазоны.
+        const double* Constants() const {
+            return reinterpret_cast<const double*>(this + 1);
+        }
+
+        const Node* Nodes() const {
+            return reinterpret_cast<const Node*>(Constants() + constant_count);
+        }
+
+        const Position* Cells() const {
+            return reinterpret_cast<const Position*>(Nodes() + std::max(node_count, code_begin + code_count));
+        }
+
+        const Range* Ranges() const {
+            return reinterpret_cast<const Range*>(Cells() + cell_count);
         }
     };
 
-    namespace {
-        class BinaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                Add = '+',
-                Subtract = '-',
-                Multiply = '*',
-                Divide = '/',
-            };
+    void Program::Deleter::operator()(Header* header) const {
+        ::operator delete(header);
+    }
 
-        public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-                    : type_(type)
-                    , lhs_(std::move(lhs))
-                    , rhs_(std::move(rhs)) {
+    Span<Node> Program::GetNodes() const {
+        return block_ != nullptr ? Span<Node>(block_->Nodes(), block_->node_count) : Span<Node>();
+    }
+
+    Span<Node> Program::GetCode() const {
+        return block_ != nullptr ? Span<Node>(block_->Nodes() + block_->code_begin, block_->code_count)
+                                 : Span<Node>();
+    }
+
+    Span<double> Program::GetConstants() const {
+        return block_ != nullptr ? Span<double>(block_->Constants(), block_->constant_count) : Span<double>();
+    }
+
+    Span<Position> Program::GetCells() const {
+        return block_ != nullptr ? Span<Position>(block_->Cells(), block_->cell_count) : Span<Position>();
+    }
+
+    Span<Range> Program::GetRanges() const {
+        return block_ != nullptr ? Span<Range>(block_->Ranges(), block_->range_count) : Span<Range>();
+    }
+
+    std::size_t Program::GetAllocatedBytes() const {
+        return block_ != nullptr ? block_->size : 0;
+    }
+
+    // Собирает программу из узлов в постфиксном порядке и проверяет, что они
+    // образуют дерево: операции применяются к значениям, функции - к аргументам.
+    // Промежуточные массивы копятся здесь, а готовая программа занимает один блок.
+    class ProgramBuilder {
+    public:
+        void Clear() {
+            nodes_.clear();
+            code_.clear();
+            constants_.clear();
+            cells_.clear();
+            ranges_.clear();
+            stack_.clear();
+            depth_ = 0;
+            max_depth_ = 0;
+        }
+
+        void PushNumber(double value) {
+            AddLeaf({OpCode::PushNumber, OpCode::Sum, Index(constants_.size())}, VALUE);
+            constants_.push_back(value);
+        }
+
+        void LoadCell(Position cell) {
+            AddLeaf({OpCode::LoadCell, OpCode::Sum, Index(cells_.size())}, VALUE);
+            cells_.push_back(cell);
+        }
+
+        // Частичный итог функции function по диапазону.
+        void LoadRange(Range range, OpCode function) {
+            auto it = std::find(ranges_.begin(), ranges_.end(), range);
+            if (it == ranges_.end()) {
+                it = ranges_.insert(it, range);
             }
+            AddLeaf({OpCode::LoadRange, function, Index(it - ranges_.begin())}, ARGUMENT);
+        }
+
+        // Арифметика, Negate, Plus и Argument - превращение значения в аргумент функции.
+        void Operation(OpCode code) {
+            const bool binary = code >= OpCode::Add && code <= OpCode::Divide;
+            AddOperation({code}, binary ? 2 : 1, VALUE, code == OpCode::Argument ? ARGUMENT : VALUE);
+        }
 
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
-                out << ' ';
-                rhs_->Print(out);
-                out << ')';
+        void Call(OpCode function, std::uint32_t argument_count) {
+            if (argument_count == 0) {
+                throw ParsingError("Program stack underflow");
             }
+            AddOperation({function, OpCode::Sum, argument_count}, argument_count, ARGUMENT, VALUE);
+        }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, true);
+        Program Build() {
+            if (stack_.size() != 1 || stack_.back().slots != VALUE) {
+                throw ParsingError("Program leaves a malformed stack");
+            }
+            // Ячейки хранятся по возрастанию без повторов, LoadCell ссылается на место ячейки в этом списке.
+            unique_cells_.assign(cells_.begin(), cells_.end());
+            std::sort(unique_cells_.begin(), unique_cells_.end());
+            unique_cells_.erase(std::unique(unique_cells_.begin(), unique_cells_.end()), unique_cells_.end());
+            for (Node& node : nodes_) {
+                if (node.code == OpCode::LoadCell) {
+                    node.operand = Index(std::lower_bound(unique_cells_.begin(), unique_cells_.end(),
+                                                          cells_[node.operand]) - unique_cells_.begin());
+                }
             }
 
-            ExprPrecedence GetPrecedence() const override {
-                switch (type_) {
-                    case Add:
-                        return EP_ADD;
-                    case Subtract:
-                        return EP_SUB;
-                    case Multiply:
-                        return EP_MUL;
-                    case Divide:
-                        return EP_DIV;
-                    default:
-                        // have to do this because VC++ has a buggy warning
-                        assert(false);
-                        return static_cast<ExprPrecedence>(INT_MAX);
+            if (!Fold()) {
+                code_.clear();
+            }
+
+            static_assert(sizeof(Program::Header) % alignof(double) == 0);
+            static_assert(alignof(Node) <= alignof(double) && alignof(Position) <= alignof(Node)
+                          && alignof(Range) <= alignof(Position));
+            const std::size_t size = sizeof(Program::Header) + SizeOf(constants_) + SizeOf(nodes_) + SizeOf(code_)
+                                     + SizeOf(unique_cells_) + SizeOf(ranges_);
+            char* memory = static_cast<char*>(::operator new(size));
+            Program program;
+            program.block_.reset(new (memory) Program::Header{
+                    Index(nodes_.size()), code_.empty() ? 0 : Index(nodes_.size()),
+                    Index(code_.empty() ? nodes_.size() : code_.size()), Index(constants_.size()),
+                    Index(unique_cells_.size()), Index(ranges_.size()), Index(max_depth_), Index(size)});
+            char* out = memory + sizeof(Program::Header);
+            out = Append(constants_, out);
+            out = Append(nodes_, out);
+            out = Append(code_, out);
+            out = Append(unique_cells_, out);
+            Append(ranges_, out);
+            Clear();
+            return program;
+        }
+
+    private:
+        // Сколько ячеек стека занимает операнд: значение - одну,
+        // аргумент функции (частичный итог и число значений) - две.
+        static constexpr std::uint32_t VALUE = 1;
+        static constexpr std::uint32_t ARGUMENT = 2;
+
+        struct Operand {
+            std::uint32_t first;
+            std::uint32_t slots;
+        };
+
+        static std::uint32_t Index(std::size_t value) {
+            return static_cast<std::uint32_t>(value);
+        }
+
+        template <typename T>
+        static std::size_t SizeOf(const std::vector<T>& values) {
+            return values.size() * sizeof(T);
+        }
+
+        template <typename T>
+        static char* Append(const std::vector<T>& values, char* out) {
+            std::uninitialized_copy(values.begin(), values.end(), reinterpret_cast<T*>(out));
+            return out + SizeOf(values);
+        }
+
+        void AddLeaf(Node node, std::uint32_t slots) {
+            node.first = Index(nodes_.size());
+            Push(node, slots);
+        }
+
+        void AddOperation(Node node, std::size_t operand_count, std::uint32_t operand_slots,
+                          std::uint32_t result_slots) {
+            if (stack_.size() < operand_count) {
+                throw ParsingError("Program stack underflow");
+            }
+            const std::size_t operands = stack_.size() - operand_count;
+            for (std::size_t i = operands; i < stack_.size(); ++i) {
+                if (stack_[i].slots != operand_slots) {
+                    throw ParsingError("Program mixes values and function arguments");
                 }
             }
+            node.first = stack_[operands].first;
+            stack_.resize(operands);
+            depth_ -= operand_count * operand_slots;
+            Push(node, result_slots);
+        }
+
+        void Push(Node node, std::uint32_t slots) {
+            stack_.push_back({node.first, slots});
+            depth_ += slots;
+            max_depth_ = std::max(max_depth_, depth_);
+            nodes_.push_back(node);
+        }
+
+        // Операнд исполняемого кода во время свёртки.
+        struct Folded {
+            // Первый узел операнда в code_.
+            std::uint32_t begin;
+            bool constant;
+            double value;
+            // Может ли значение оказаться -0: x+0 не равно x только при x = -0.
+            bool may_be_negative_zero;
+        };
+
+        static bool IsNegativeZero(double value) {
+            return value == 0.0 && std::signbit(value);
+        }
+
+        static bool IsPositiveZero(double value) {
+            return value == 0.0 && !std::signbit(value);
+        }
+
+        // Нейтральна ли константа c справа: x op c == x для любого конечного x.
+        // Значения формул всегда конечны, бесконечность сразу становится ошибкой.
+        static bool IsRightIdentity(OpCode code, const Folded& lhs, const Folded& rhs) {
+            if (!rhs.constant) return false;
+            switch (code) {
+                case OpCode::Add:
+                    return IsNegativeZero(rhs.value) || (IsPositiveZero(rhs.value) && !lhs.may_be_negative_zero);
+                case OpCode::Subtract:
+                    return IsPositiveZero(rhs.value);
+                default:
+                    return rhs.value == 1.0;
+            }
+        }
+
+        static bool IsLeftIdentity(OpCode code, const Folded& lhs, const Folded& rhs) {
+            if (!lhs.constant) return false;
+            switch (code) {
+                case OpCode::Add:
+                    return IsNegativeZero(lhs.value) || (IsPositiveZero(lhs.value) && !rhs.may_be_negative_zero);
+                case OpCode::Multiply:
+                    return lhs.value == 1.0;
+                default:
+                    return false;
+            }
+        }
+
+        void Emit(Node node, std::uint32_t first) {
+            node.first = first;
+            code_.push_back(node);
+        }
+
+        // Заменяет код операнда одним числом.
+        void ReplaceWithConstant(Folded& operand, double value) {
+            code_.resize(operand.begin);
+            Emit({OpCode::PushNumber, OpCode::Sum, Index(constants_.size())}, operand.begin);
+            constants_.push_back(value);
+            operand.constant = true;
+            operand.value = value;
+            operand.may_be_negative_zero = IsNegativeZero(value);
+        }
 
-            double Evaluate(std::function<double(Position)> get_cell_value) const override {
-                double result;
-                switch (type_) {
-                    case Type::Add:
-                        result = lhs_->Evaluate(get_cell_value) + rhs_->Evaluate(get_cell_value);
+        // Строит в code_ исполняемый код из дерева: поддеревья из констант
+        // с конечным значением заменяются числом, убираются унарный плюс,
+        // двойное отрицание и тождества x*1, 1*x, x/1, x-0, x+0. Результат
+        // совпадает с исходным до бита, включая знак нуля. Поддеревья с
+        // бесконечным значением остаются как есть: #ARITHM! появляется при
+        // вычислении на прежнем месте, после ошибок ячеек, стоящих левее.
+        // Возвращает false, если код совпал с деревом.
+        bool Fold() {
+            code_.clear();
+            folded_.clear();
+            bool changed = false;
+            for (const Node& node : nodes_) {
+                const std::uint32_t begin = Index(code_.size());
+                switch (node.code) {
+                    case OpCode::PushNumber: {
+                        const double value = constants_[node.operand];
+                        Emit(node, begin);
+                        folded_.push_back({begin, true, value, IsNegativeZero(value)});
                         break;
-                    case Type::Subtract:
-                        result = lhs_->Evaluate(get_cell_value) - rhs_->Evaluate(get_cell_value);
+                    }
+                    case OpCode::LoadCell:
+                    case OpCode::LoadRange:
+                        Emit(node, begin);
+                        folded_.push_back({begin, false, 0.0, true});
                         break;
-                    case Type::Multiply:
-                        result = lhs_->Evaluate(get_cell_value) * rhs_->Evaluate(get_cell_value);
+                    case OpCode::Plus:
+                        changed = true;
                         break;
-                    case Type::Divide:
-                        result = lhs_->Evaluate(get_cell_value) / rhs_->Evaluate(get_cell_value);
+                    case OpCode::Negate: {
+                        Folded& operand = folded_.back();
+                        if (operand.constant) {
+                            ReplaceWithConstant(operand, -operand.value);
+                            changed = true;
+                        } else if (code_.back().code == OpCode::Negate) {
+                            code_.pop_back();
+                            changed = true;
+                        } else {
+                            Emit(node, operand.begin);
+                            operand.may_be_negative_zero = true;
+                        }
+                        break;
+                    }
+                    case OpCode::Argument:
+                        // Константа остаётся видна функции, чтобы её можно было свернуть.
+                        Emit(node, folded_.back().begin);
+                        break;
+                    case OpCode::Add:
+                    case OpCode::Subtract:
+                    case OpCode::Multiply:
+                    case OpCode::Divide:
+                        changed |= FoldBinary(node);
                         break;
                     default:
+                        changed |= FoldCall(node);
                         break;
                 }
+            }
+            return changed;
+        }
+
+        bool FoldBinary(const Node& node) {
+            const Folded rhs = folded_.back();
+            folded_.pop_back();
+            Folded& lhs = folded_.back();
+            if (lhs.constant && rhs.constant) {
+                const double result = Apply(node.code, lhs.value, rhs.value);
                 if (std::isfinite(result)) {
-                    return result;
-                } else {
-                    throw FormulaError(FormulaError::Category::Arithmetic);
+                    ReplaceWithConstant(lhs, result);
+                    return true;
                 }
+            } else if (IsRightIdentity(node.code, lhs, rhs)) {
+                code_.resize(rhs.begin);
+                return true;
+            } else if (IsLeftIdentity(node.code, lhs, rhs)) {
+                // Константа слева - один узел, код правого операнда сдвигается на его место.
+                code_.erase(code_.begin() + lhs.begin);
+                for (std::size_t i = lhs.begin; i < code_.size(); ++i) {
+                    --code_[i].first;
+                }
+                lhs = {lhs.begin, false, 0.0, rhs.may_be_negative_zero};
+                return true;
             }
+            Emit(node, lhs.begin);
+            // a+b равно -0, только если оба слагаемых -0, a-b - только если a = -0.
+            const bool may_be_negative_zero = node.code == OpCode::Add
+                    ? lhs.may_be_negative_zero && rhs.may_be_negative_zero
+                    : node.code == OpCode::Subtract ? lhs.may_be_negative_zero : true;
+            lhs = {lhs.begin, false, 0.0, may_be_negative_zero};
+            return false;
+        }
 
-        private:
-            Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
-        };
+        // Функция от одних констант считается так же, как при выполнении:
+        // частичные итоги аргументов объединяются слева направо.
+        bool FoldCall(const Node& node) {
+            const std::size_t args = folded_.size() - node.operand;
+            Folded& result = folded_[args];
+            const bool constant = std::all_of(folded_.begin() + args, folded_.end(), [](const Folded& arg) {
+                return arg.constant;
+            });
+            if (constant) {
+                double partial = folded_[args].value;
+                for (std::size_t i = args + 1; i < folded_.size(); ++i) {
+                    partial = Combine(node.code, partial, folded_[i].value);
+                }
+                try {
+                    const double value = Finish(node.code, partial, static_cast<double>(node.operand));
+                    folded_.resize(args + 1);
+                    ReplaceWithConstant(result, value);
+                    return true;
+                } catch (const FormulaError&) {
+                }
+            }
+            Emit(node, result.begin);
+            result = {result.begin, false, 0.0, node.code != OpCode::Count};
+            folded_.resize(args + 1);
+            return false;
+        }
 
-        class UnaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                UnaryPlus = '+',
-                UnaryMinus = '-',
-            };
+        std::vector<Node> nodes_;
+        // Исполняемый код после свёртки констант.
+        std::vector<Node> code_;
+        std::vector<Folded> folded_;
+        std::vector<double> constants_;
+        // Ячейки в порядке записи, по одной на LoadCell.
+        std::vector<Position> cells_;
+        std::vector<Position> unique_cells_;
+        std::vector<Range> ranges_;
+        // Операнды, ещё не использованные операциями.
+        std::vector<Operand> stack_;
+        std::size_t depth_ = 0;
+        std::size_t max_depth_ = 0;
+    };
 
+    namespace {
+        // Сборщик переиспользуется разборами в одном потоке, поэтому
+        // промежуточные массивы не выделяются для каждой формулы заново.
+        ProgramBuilder& ThreadBuilder() {
+            thread_local ProgramBuilder builder;
+            builder.Clear();
+            return builder;
+        }
+
+        // Программа как дерево: печать и рекурсивное вычисление по ссылкам-индексам.
+        class Tree {
         public:
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-                    : type_(type)
-                    , operand_(std::move(operand)) {
+            // Ссылки программы читаются сдвинутыми на offset.
+            explicit Tree(const Program& program, Position offset = {})
+                    : nodes_(program.GetNodes())
+                    , constants_(program.GetConstants())
+                    , cells_(program.GetCells(), offset)
+                    , ranges_(program.GetRanges(), offset) {
             }
 
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
-                out << ')';
+            std::size_t Root() const {
+                return nodes_.size() - 1;
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+            void Print(std::ostream& out, std::size_t index) const {
+                const Node& node = nodes_[index];
+                switch (node.code) {
+                    case OpCode::PushNumber:
+                        out << constants_[node.operand];
+                        break;
+                    case OpCode::LoadCell:
+                        PrintCell(out, cells_[node.operand]);
+                        break;
+                    case OpCode::LoadRange:
+                        PrintRange(out, ranges_[node.operand]);
+                        break;
+                    case OpCode::Negate:
+                    case OpCode::Plus:
+                        out << '(' << GetOperator(node.code) << ' ';
+                        Print(out, index - 1);
+                        out << ')';
+                        break;
+                    case OpCode::Add:
+                    case OpCode::Subtract:
+                    case OpCode::Multiply:
+                    case OpCode::Divide:
+                        out << '(' << GetOperator(node.code) << ' ';
+                        Print(out, Left(index));
+                        out << ' ';
+                        Print(out, index - 1);
+                        out << ')';
+                        break;
+                    default:
+                        out << '(' << GetFunctionName(node.code);
+                        for (std::size_t arg : Arguments(index)) {
+                            out << ' ';
+                            Print(out, arg);
+                        }
+                        out << ')';
+                }
             }
 
-            ExprPrecedence GetPrecedence() const override {
-                return EP_UNARY;
+            void PrintFormula(std::ostream& out, std::size_t index, ExprPrecedence parent_precedence,
+                              bool right_child = false) const {
+                const ExprPrecedence precedence = GetPrecedence(index);
+                const auto mask = right_child ? PR_RIGHT : PR_LEFT;
+                const bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+                if (parens_needed) {
+                    out << '(';
+                }
+
+                const Node& node = nodes_[index];
+                switch (node.code) {
+                    case OpCode::PushNumber:
+                    case OpCode::LoadCell:
+                    case OpCode::LoadRange:
+                        Print(out, index);
+                        break;
+                    case OpCode::Negate:
+                    case OpCode::Plus:
+                        out << GetOperator(node.code);
+                        PrintFormula(out, index - 1, precedence);
+                        break;
+                    case OpCode::Add:
+                    case OpCode::Subtract:
+                    case OpCode::Multiply:
+                    case OpCode::Divide:
+                        PrintFormula(out, Left(index), precedence);
+                        out << GetOperator(node.code);
+                        PrintFormula(out, index - 1, precedence, true);
+                        break;
+                    default: {
+                        out << GetFunctionName(node.code) << '(';
+                        bool first = true;
+                        for (std::size_t arg : Arguments(index)) {
+                            if (!first) {
+                                out << ',';
+                            }
+                            first = false;
+                            PrintFormula(out, arg, EP_ATOM);
+                        }
+                        out << ')';
+                    }
+                }
+
+                if (parens_needed) {
+                    out << ')';
+                }
             }
 
-            double Evaluate(std::function<double(Position)> get_cell_value) const override {
-                if (type_ == Type::UnaryMinus) {
-                    return -operand_->Evaluate(get_cell_value);
-                } else {
-                    return operand_->Evaluate(get_cell_value);
+            double Evaluate(std::size_t index, const std::function<double(Position)>& get_cell_value,
+                            const RangeReader& get_range_values) const {
+                const Node& node = nodes_[index];
+                switch (node.code) {
+                    case OpCode::PushNumber:
+                        return constants_[node.operand];
+                    case OpCode::LoadCell:
+                        return get_cell_value(cells_[node.operand]);
+                    case OpCode::Plus:
+                        return Evaluate(index - 1, get_cell_value, get_range_values);
+                    case OpCode::Negate:
+                        return -Evaluate(index - 1, get_cell_value, get_range_values);
+                    case OpCode::Add:
+                    case OpCode::Subtract:
+                    case OpCode::Multiply:
+                    case OpCode::Divide: {
+                        const double lhs = Evaluate(Left(index), get_cell_value, get_range_values);
+                        const double rhs = Evaluate(index - 1, get_cell_value, get_range_values);
+                        const double result = Apply(node.code, lhs, rhs);
+                        if (!std::isfinite(result)) {
+                            throw FormulaError(FormulaError::Category::Arithmetic);
+                        }
+                        return result;
+                    }
+                    case OpCode::LoadRange:
+                    case OpCode::Argument:
+                        // Диапазон бывает только аргументом функции.
+                        throw FormulaError(FormulaError::Category::Value);
+                    default: {
+                        std::vector<double> values;
+                        for (std::size_t arg : Arguments(index)) {
+                            if (nodes_[arg].code != OpCode::LoadRange) {
+                                values.push_back(Evaluate(arg, get_cell_value, get_range_values));
+                                continue;
+                            }
+                            get_range_values(ranges_[nodes_[arg].operand], values);
+                        }
+                        return Finish(node.code, Reduce(node.code, values.data(), values.size()),
+                                      static_cast<double>(values.size()));
+                    }
                 }
             }
 
         private:
-            Type type_;
-            std::unique_ptr<Expr> operand_;
-        };
+            static char GetOperator(OpCode code) {
+                switch (code) {
+                    case OpCode::Add:
+                    case OpCode::Plus:
+                        return '+';
+                    case OpCode::Subtract:
+                    case OpCode::Negate:
+                        return '-';
+                    case OpCode::Multiply:
+                        return '*';
+                    default:
+                        return '/';
+                }
+            }
 
-        class CellExpr final : public Expr {
-        public:
-            explicit CellExpr(const Position* cell)
-                    : cell_(cell) {
+            static void PrintCell(std::ostream& out, Position cell) {
+                if (!cell.IsValid()) {
+                    out << FormulaError::Category::Ref;
+                } else {
+                    out << cell.ToString();
+                }
             }
 
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
+            static void PrintRange(std::ostream& out, Range range) {
+                if (!range.first.IsValid() || !range.last.IsValid()) {
                     out << FormulaError::Category::Ref;
                 } else {
-                    out << cell_->ToString();
+                    out << range.ToString();
                 }
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence) const override {
-                Print(out);
+            ExprPrecedence GetPrecedence(std::size_t index) const {
+                switch (nodes_[index].code) {
+                    case OpCode::Add:
+                        return EP_ADD;
+                    case OpCode::Subtract:
+                        return EP_SUB;
+                    case OpCode::Multiply:
+                        return EP_MUL;
+                    case OpCode::Divide:
+                        return EP_DIV;
+                    case OpCode::Negate:
+                    case OpCode::Plus:
+                        return EP_UNARY;
+                    default:
+                        return EP_ATOM;
+                }
             }
 
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
+            // Корень левого операнда: он заканчивается перед первым узлом правого.
+            std::size_t Left(std::size_t index) const {
+                return nodes_[index - 1].first - 1;
             }
 
-            double Evaluate(std::function<double(Position)> get_cell_value) const override {
-                return get_cell_value(*cell_);
+            // Корни аргументов функции в порядке записи. Выражение-аргумент
+            // обёрнуто в узел Argument, возвращается само выражение.
+            std::vector<std::size_t> Arguments(std::size_t index) const {
+                std::vector<std::size_t> args(nodes_[index].operand);
+                std::size_t root = index - 1;
+                for (auto it = args.rbegin(); it != args.rend(); ++it) {
+                    *it = nodes_[root].code == OpCode::Argument ? root - 1 : root;
+                    root = nodes_[root].first - 1;
+                }
+                return args;
             }
 
-        private:
-            const Position* cell_;
+            Span<Node> nodes_;
+            Span<double> constants_;
+            ShiftedSpan<Position> cells_;
+            ShiftedSpan<Range> ranges_;
         };
 
-        class NumberExpr final : public Expr {
+        // Рекурсивный спуск по грамматике Formula.g4:
+        //   expr  := term (('+' | '-') term)*
+        //   term  := unary (('*' | '/') unary)*
+        //   unary := ('+' | '-') unary | atom
+        //   atom  := NUMBER | CELL | FUNCTION '(' arg (',' arg)* ')' | '(' expr ')'
+        //   arg   := CELL ':' CELL | expr
+        // Работает прямо по string_view, лексемы не копируются.
+        class FormulaTextParser {
         public:
-            explicit NumberExpr(double value)
-                    : value_(value) {
+            explicit FormulaTextParser(std::string_view text)
+                    : text_(text) {
+            }
+
+            FormulaAST Parse() {
+                Advance();
+                ParseExpr();
+                if (token_.type != TokenType::End) {
+                    throw ParsingError("Error when parsing: "s.append(token_.text));
+                }
+                // Как и в ANTLR-варианте, некорректные число и позиция ячейки
+                // обнаруживаются только после успешного разбора всей формулы.
+                switch (deferred_error_) {
+                    case DeferredError::None:
+                        break;
+                    case DeferredError::Number:
+                        throw ParsingError("Invalid number: "s.append(deferred_error_text_));
+                    case DeferredError::Cell:
+                        throw FormulaException("Invalid position: "s.append(deferred_error_text_));
+                }
+                return FormulaAST(builder_.Build());
+            }
+
+        private:
+            enum class TokenType {
+                Number,
+                Cell,
+                Function,
+                Add,
+                Sub,
+                Mul,
+                Div,
+                LeftParen,
+                RightParen,
+                Colon,
+                Comma,
+                End,
+            };
+
+            enum class DeferredError {
+                None,
+                Number,
+                Cell,
+            };
+
+            struct Token {
+                TokenType type = TokenType::End;
+                std::string_view text;
+            };
+
+            static bool IsDigit(char ch) {
+                return ch >= '0' && ch <= '9';
             }
 
-            void Print(std::ostream& out) const override {
-                out << value_;
+            static bool IsUpper(char ch) {
+                return ch >= 'A' && ch <= 'Z';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence) const override {
-                out << value_;
+            std::size_t SkipDigits(std::size_t pos) const {
+                while (pos < text_.size() && IsDigit(text_[pos])) {
+                    ++pos;
+                }
+                return pos;
             }
 
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
+            static bool IsSpace(char ch) {
+                return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
             }
 
-            double Evaluate(std::function<double(Position)>) const override {
-                return value_;
+            // Первый значимый символ после текущей лексемы.
+            char PeekChar() const {
+                std::size_t pos = pos_;
+                while (pos < text_.size() && IsSpace(text_[pos])) {
+                    ++pos;
+                }
+                return pos < text_.size() ? text_[pos] : '\0';
             }
 
-        private:
-            double value_;
-        };
+            void Advance() {
+                while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+                    ++pos_;
+                }
+                if (pos_ == text_.size()) {
+                    token_ = {TokenType::End, "<EOF>"sv};
+                    return;
+                }
 
-        class ParseASTListener final : public FormulaBaseListener {
-        public:
-            std::unique_ptr<Expr> MoveRoot() {
-                assert(args_.size() == 1);
-                auto root = std::move(args_.front());
-                args_.clear();
+                std::size_t start = pos_;
+                char ch = text_[pos_];
+                TokenType type;
+                switch (ch) {
+                    case '+':
+                        type = TokenType::Add;
+                        ++pos_;
+                        break;
+                    case '-':
+                        type = TokenType::Sub;
+                        ++pos_;
+                        break;
+                    case '*':
+                        type = TokenType::Mul;
+                        ++pos_;
+                        break;
+                    case '/':
+                        type = TokenType::Div;
+                        ++pos_;
+                        break;
+                    case '(':
+                        type = TokenType::LeftParen;
+                        ++pos_;
+                        break;
+                    case ')':
+                        type = TokenType::RightParen;
+                        ++pos_;
+                        break;
+                    case ':':
+                        type = TokenType::Colon;
+                        ++pos_;
+                        break;
+                    case ',':
+                        type = TokenType::Comma;
+                        ++pos_;
+                        break;
+                    default:
+                        if (IsUpper(ch)) {
+                            while (pos_ < text_.size() && IsUpper(text_[pos_])) {
+                                ++pos_;
+                            }
+                            std::size_t digits_end = SkipDigits(pos_);
+                            if (digits_end != pos_) {
+                                pos_ = digits_end;
+                                type = TokenType::Cell;
+                            } else if (FindFunction(text_.substr(start, pos_ - start))) {
+                                type = TokenType::Function;
+                            } else {
+                                ThrowLexerError(start);
+                            }
+                        } else if (std::size_t length = MatchNumberLiteral(text_.substr(pos_)); length > 0) {
+                            pos_ += length;
+                            type = TokenType::Number;
+                        } else {
+                            ThrowLexerError(start);
+                        }
+                }
+                token_ = {type, text_.substr(start, pos_ - start)};
+            }
 
-                return root;
+            [[noreturn]] void ThrowLexerError(std::size_t pos) const {
+                throw ParsingError("Error when lexing: token recognition error at: '"s
+                                   + std::string(text_.substr(pos, 1)) + "'"s);
             }
 
-            std::forward_list<Position> MoveCells() {
-                return std::move(cells_);
+            [[noreturn]] void ThrowUnexpectedToken() const {
+                throw ParsingError("Error when parsing: "s.append(token_.text));
             }
 
-        public:
-            void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-                assert(args_.size() >= 1);
+            void ParseExpr() {
+                ParseTerm();
+                while (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+                    const OpCode code = token_.type == TokenType::Add ? OpCode::Add : OpCode::Subtract;
+                    Advance();
+                    ParseTerm();
+                    builder_.Operation(code);
+                }
+            }
+
+            void ParseTerm() {
+                ParseUnary();
+                while (token_.type == TokenType::Mul || token_.type == TokenType::Div) {
+                    const OpCode code = token_.type == TokenType::Mul ? OpCode::Multiply : OpCode::Divide;
+                    Advance();
+                    ParseUnary();
+                    builder_.Operation(code);
+                }
+            }
+
+            void ParseUnary() {
+                if (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+                    const OpCode code = token_.type == TokenType::Add ? OpCode::Plus : OpCode::Negate;
+                    Advance();
+                    ParseUnary();
+                    builder_.Operation(code);
+                    return;
+                }
+                ParseAtom();
+            }
 
-                auto operand = std::move(args_.back());
+            void ParseAtom() {
+                switch (token_.type) {
+                    case TokenType::Number:
+                        builder_.PushNumber(ParseNumber(token_.text));
+                        break;
+                    case TokenType::Cell:
+                        builder_.LoadCell(ParsePosition(token_.text));
+                        break;
+                    case TokenType::Function: {
+                        OpCode function = *FindFunction(token_.text);
+                        Advance();
+                        if (token_.type != TokenType::LeftParen) {
+                            ThrowUnexpectedToken();
+                        }
+                        std::uint32_t argument_count = 0;
+                        do {
+                            Advance();
+                            ParseArgument(function);
+                            ++argument_count;
+                        } while (token_.type == TokenType::Comma);
+                        if (token_.type != TokenType::RightParen) {
+                            ThrowUnexpectedToken();
+                        }
+                        builder_.Call(function, argument_count);
+                        break;
+                    }
+                    case TokenType::LeftParen:
+                        Advance();
+                        ParseExpr();
+                        if (token_.type != TokenType::RightParen) {
+                            ThrowUnexpectedToken();
+                        }
+                        break;
+                    default:
+                        ThrowUnexpectedToken();
+                }
+                Advance();
+            }
+
+            void ParseArgument(OpCode function) {
+                if (token_.type != TokenType::Cell || PeekChar() != ':') {
+                    ParseExpr();
+                    builder_.Operation(OpCode::Argument);
+                    return;
+                }
+                Position first = ParsePosition(token_.text);
+                Advance();
+                Advance();
+                if (token_.type != TokenType::Cell) {
+                    ThrowUnexpectedToken();
+                }
+                Position last = ParsePosition(token_.text);
+                Advance();
+                builder_.LoadRange(Range::FromCorners(first, last), function);
+            }
 
-                UnaryOpExpr::Type type;
+            Position ParsePosition(std::string_view text) {
+                auto value = Position::FromString(text);
+                if (!value.IsValid()) {
+                    Defer(DeferredError::Cell, text);
+                }
+                return value;
+            }
+
+            void Defer(DeferredError error, std::string_view text) {
+                if (deferred_error_ == DeferredError::None) {
+                    deferred_error_ = error;
+                    deferred_error_text_ = text;
+                }
+            }
+
+            double ParseNumber(std::string_view text) {
+                std::optional<double> value = ParseNumberLiteral(text);
+                if (!value) {
+                    Defer(DeferredError::Number, text);
+                    return 0.0;
+                }
+                return *value;
+            }
+
+            std::string_view text_;
+            std::size_t pos_ = 0;
+            Token token_;
+            ProgramBuilder& builder_ = ThreadBuilder();
+            DeferredError deferred_error_ = DeferredError::None;
+            std::string_view deferred_error_text_;
+        };
+
+        // Обход дерева ANTLR. Ветви диапазонов и функций (exitRange, enterCall,
+        // exitCall, exitArgument) ни разу не собирались с antlr4_runtime и не
+        // сверялись с FormulaTextParser: это нужно сделать в полной сборке.
+        class ParseASTListener final : public FormulaBaseListener {
+        public:
+            Program Build() {
+                return builder_.Build();
+            }
+
+        public:
+            void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
                 if (ctx->SUB()) {
-                    type = UnaryOpExpr::UnaryMinus;
+                    builder_.Operation(OpCode::Negate);
                 } else {
                     assert(ctx->ADD() != nullptr);
-                    type = UnaryOpExpr::UnaryPlus;
+                    builder_.Operation(OpCode::Plus);
                 }
-
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args_.back() = std::move(node);
             }
 
             void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -283,44 +1136,46 @@ namespace ASTImpl {
                     throw ParsingError("Invalid number: " + valueStr);
                 }
 
-                auto node = std::make_unique<NumberExpr>(value);
-                args_.push_back(std::move(node));
+                builder_.PushNumber(value);
             }
 
             void exitCell(FormulaParser::CellContext* ctx) override {
-                auto value_str = ctx->CELL()->getSymbol()->getText();
-                auto value = Position::FromString(value_str);
-                if (!value.IsValid()) {
-                    throw FormulaException("Invalid position: " + value_str);
-                }
+                builder_.LoadCell(ParsePosition(ctx->CELL()->getSymbol()->getText()));
+            }
 
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
-                args_.push_back(std::move(node));
+            void exitRange(FormulaParser::RangeContext* ctx) override {
+                auto first = ParsePosition(ctx->CELL(0)->getSymbol()->getText());
+                auto last = ParsePosition(ctx->CELL(1)->getSymbol()->getText());
+
+                builder_.LoadRange(Range::FromCorners(first, last), functions_.back());
             }
 
-            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-                assert(args_.size() >= 2);
+            void exitArgument(FormulaParser::ArgumentContext* /* ctx */) override {
+                builder_.Operation(OpCode::Argument);
+            }
 
-                auto rhs = std::move(args_.back());
-                args_.pop_back();
+            void enterCall(FormulaParser::CallContext* ctx) override {
+                auto function = FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+                assert(function.has_value());
+                functions_.push_back(*function);
+            }
 
-                auto lhs = std::move(args_.back());
+            void exitCall(FormulaParser::CallContext* ctx) override {
+                builder_.Call(functions_.back(), static_cast<std::uint32_t>(ctx->arg().size()));
+                functions_.pop_back();
+            }
 
-                BinaryOpExpr::Type type;
+            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
                 if (ctx->ADD()) {
-                    type = BinaryOpExpr::Add;
+                    builder_.Operation(OpCode::Add);
                 } else if (ctx->SUB()) {
-                    type = BinaryOpExpr::Subtract;
+                    builder_.Operation(OpCode::Subtract);
                 } else if (ctx->MUL()) {
-                    type = BinaryOpExpr::Multiply;
+                    builder_.Operation(OpCode::Multiply);
                 } else {
                     assert(ctx->DIV() != nullptr);
-                    type = BinaryOpExpr::Divide;
+                    builder_.Operation(OpCode::Divide);
                 }
-
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args_.back() = std::move(node);
             }
 
             void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -328,8 +1183,17 @@ namespace ASTImpl {
             }
 
         private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
+            static Position ParsePosition(const std::string& text) {
+                auto value = Position::FromString(text);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + text);
+                }
+                return value;
+            }
+
+            ProgramBuilder& builder_ = ThreadBuilder();
+            // Функции, внутри аргументов которых сейчас идёт обход.
+            std::vector<OpCode> functions_;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener {
@@ -341,11 +1205,421 @@ namespace ASTImpl {
                 throw ParsingError("Error when lexing: " + msg);
             }
         };
+    }  // namespace
+
+    namespace {
+        // Читатель диапазонов для формул, в которых их быть не должно.
+        void ReadNoRanges(Range, std::vector<double>&) {
+            throw std::logic_error("Formula with ranges needs a RangeReader");
+        }
+    }  // namespace
+
+    double Program::Execute(const std::function<double(Position)>& get_cell_value) const {
+        return Execute(get_cell_value, ReadNoRanges);
+    }
+
+    double Program::Execute(const std::function<double(Position)>& get_cell_value,
+                            const RangeReader& get_range_values) const {
+        const Header& program = *block_;
+        const double* constants = program.Constants();
+        const Position* cells = program.Cells();
+        const Range* ranges = program.Ranges();
+
+        constexpr std::size_t INLINE_STACK_SIZE = 64;
+        double inline_stack[INLINE_STACK_SIZE];
+        std::vector<double> heap_stack;
+        double* stack = inline_stack;
+        if (program.max_depth > INLINE_STACK_SIZE) {
+            heap_stack.resize(program.max_depth);
+            stack = heap_stack.data();
+        }
+        // Значения диапазона собираются подряд, чтобы свёртка шла по массиву.
+        std::vector<double> range_values;
+
+        // top указывает на свободную ячейку над вершиной стека.
+        double* top = stack;
+        for (const Node& instruction : GetCode()) {
+            switch (instruction.code) {
+                case OpCode::PushNumber:
+                    *top++ = constants[instruction.operand];
+                    continue;
+                case OpCode::LoadCell:
+                    *top++ = get_cell_value(cells[instruction.operand]);
+                    continue;
+                case OpCode::Negate:
+                    top[-1] = -top[-1];
+                    continue;
+                case OpCode::Plus:
+                    continue;
+                case OpCode::LoadRange:
+                    range_values.clear();
+                    get_range_values(ranges[instruction.operand], range_values);
+                    top[0] = Reduce(instruction.function, range_values.data(), range_values.size());
+                    top[1] = static_cast<double>(range_values.size());
+                    top += 2;
+                    continue;
+                case OpCode::Argument:
+                    *top++ = 1.0;
+                    continue;
+                case OpCode::Sum:
+                case OpCode::Min:
+                case OpCode::Max:
+                case OpCode::Average:
+                case OpCode::Count: {
+                    double* args = top - 2 * std::size_t{instruction.operand};
+                    double partial = args[0];
+                    double count = args[1];
+                    for (std::uint32_t i = 1; i < instruction.operand; ++i) {
+                        partial = Combine(instruction.code, partial, args[2 * i]);
+                        count += args[2 * i + 1];
+                    }
+                    args[0] = Finish(instruction.code, partial, count);
+                    top = args + 1;
+                    continue;
+                }
+                case OpCode::Add:
+                    top[-2] += top[-1];
+                    break;
+                case OpCode::Subtract:
+                    top[-2] -= top[-1];
+                    break;
+                case OpCode::Multiply:
+                    top[-2] *= top[-1];
+                    break;
+                case OpCode::Divide:
+                    top[-2] /= top[-1];
+                    break;
+            }
+            --top;
+            if (!std::isfinite(top[-1])) {
+                throw FormulaError(FormulaError::Category::Arithmetic);
+            }
+        }
+        assert(top == stack + 1);
+        return stack[0];
+    }
+
+    namespace {
+        template <typename T>
+        void Put(std::string& out, T value) {
+            char bytes[sizeof(T)];
+            std::memcpy(bytes, &value, sizeof(T));
+            out.append(bytes, sizeof(T));
+        }
+
+        template <typename T>
+        T Take(std::string_view& bytes) {
+            if (bytes.size() < sizeof(T)) throw ParsingError("Program is truncated");
+            T value;
+            std::memcpy(&value, bytes.data(), sizeof(T));
+            bytes.remove_prefix(sizeof(T));
+            return value;
+        }
+
+        // Разбирает двоичное представление Serialize и передаёт инструкции
+        // в visitor с интерфейсом ProgramBuilder.
+        template <typename Visitor>
+        void Decode(std::string_view bytes, Visitor& visitor) {
+            while (!bytes.empty()) {
+                const auto code = Take<OpCode>(bytes);
+                switch (code) {
+                    case OpCode::PushNumber:
+                        visitor.PushNumber(Take<double>(bytes));
+                        break;
+                    case OpCode::LoadCell: {
+                        Position cell;
+                        cell.row = Take<std::int32_t>(bytes);
+                        cell.col = Take<std::int32_t>(bytes);
+                        if (!cell.IsValid()) throw ParsingError("Program refers to an invalid cell");
+                        visitor.LoadCell(cell);
+                        break;
+                    }
+                    case OpCode::LoadRange: {
+                        const auto function = Take<OpCode>(bytes);
+                        if (!IsFunction(function)) throw ParsingError("Unknown range function");
+                        Range range;
+                        range.first.row = Take<std::int32_t>(bytes);
+                        range.first.col = Take<std::int32_t>(bytes);
+                        range.last.row = Take<std::int32_t>(bytes);
+                        range.last.col = Take<std::int32_t>(bytes);
+                        if (!range.first.IsValid() || !range.last.IsValid()
+                            || !(Range::FromCorners(range.first, range.last) == range)) {
+                            throw ParsingError("Program refers to an invalid range");
+                        }
+                        visitor.LoadRange(range, function);
+                        break;
+                    }
+                    case OpCode::Sum:
+                    case OpCode::Min:
+                    case OpCode::Max:
+                    case OpCode::Average:
+                    case OpCode::Count:
+                        visitor.Call(code, Take<std::uint32_t>(bytes));
+                        break;
+                    case OpCode::Negate:
+                    case OpCode::Argument:
+                    case OpCode::Add:
+                    case OpCode::Subtract:
+                    case OpCode::Multiply:
+                    case OpCode::Divide:
+                        visitor.Operation(code);
+                        break;
+                    default:
+                        throw ParsingError("Unknown program instruction");
+                }
+            }
+        }
+    }  // namespace
+
+    bool Program::ExecuteRun(std::size_t count, const ColumnReader& read_column, double* results,
+                             std::optional<FormulaError>* errors) const {
+        for (const Node& instruction : GetCode()) {
+            if (instruction.code >= OpCode::LoadRange && instruction.code <= OpCode::Count) {
+                return false;
+            }
+        }
+        const Header& program = *block_;
+        const double* constants = program.Constants();
+        const Position* cells = program.Cells();
+
+        // Стек из столбцов по count значений; k-й элемент столбца относится к k-й формуле.
+        std::vector<double> stack(std::size_t{program.max_depth} * count);
+        std::vector<std::optional<FormulaError>> cell_errors(count);
+        std::fill(errors, errors + count, std::nullopt);
+        // Формула останавливается на первой ошибке, поэтому у каждой формулы
+        // запоминается только первая ошибка в порядке выполнения.
+        auto fail = [errors](std::size_t k, FormulaError error) {
+            if (!errors[k]) errors[k] = error;
+        };
+
+        double* top = stack.data();
+        for (const Node& instruction : GetCode()) {
+            switch (instruction.code) {
+                case OpCode::PushNumber:
+                    std::fill(top, top + count, constants[instruction.operand]);
+                    top += count;
+                    continue;
+                case OpCode::LoadCell:
+                    std::fill(cell_errors.begin(), cell_errors.end(), std::nullopt);
+                    read_column(cells[instruction.operand], count, top, cell_errors.data());
+                    for (std::size_t k = 0; k < count; ++k) {
+                        if (cell_errors[k]) fail(k, *cell_errors[k]);
+                    }
+                    top += count;
+                    continue;
+                case OpCode::Negate:
+                    for (double* value = top - count; value != top; ++value) *value = -*value;
+                    continue;
+                case OpCode::Plus:
+                    continue;
+                default:
+                    break;
+            }
+            top -= count;
+            double* lhs = top - count;
+            ApplyColumns(instruction.code, lhs, top, count);
+            for (std::size_t k = 0; k < count; ++k) {
+                if (!std::isfinite(lhs[k])) fail(k, FormulaError(FormulaError::Category::Arithmetic));
+            }
+        }
+        assert(top == stack.data() + count);
+        std::copy(stack.data(), top, results);
+        return true;
+    }
+
+    void Program::Shift(Position offset) {
+        // Блок принадлежит программе, наружу таблицы выдаются только для чтения.
+        Position* cells = const_cast<Position*>(block_->Cells());
+        for (std::uint32_t i = 0; i < block_->cell_count; ++i) {
+            cells[i] = cells[i].Shifted(offset);
+        }
+        Range* ranges = const_cast<Range*>(block_->Ranges());
+        for (std::uint32_t i = 0; i < block_->range_count; ++i) {
+            ranges[i] = ranges[i].Shifted(offset);
+        }
+    }
 
+    void Program::Serialize(std::string& out, Position offset) const {
+        const ShiftedSpan<Position> cells(GetCells(), offset);
+        const ShiftedSpan<Range> ranges(GetRanges(), offset);
+        for (const Node& instruction : GetCode()) {
+            if (instruction.code == OpCode::Plus) {
+                continue;
+            }
+            Put(out, instruction.code);
+            if (instruction.code == OpCode::PushNumber) {
+                Put(out, GetConstants()[instruction.operand]);
+            } else if (instruction.code == OpCode::LoadCell) {
+                const Position cell = cells[instruction.operand];
+                Put<std::int32_t>(out, cell.row);
+                Put<std::int32_t>(out, cell.col);
+            } else if (instruction.code == OpCode::LoadRange) {
+                const Range range = ranges[instruction.operand];
+                Put(out, instruction.function);
+                Put<std::int32_t>(out, range.first.row);
+                Put<std::int32_t>(out, range.first.col);
+                Put<std::int32_t>(out, range.last.row);
+                Put<std::int32_t>(out, range.last.col);
+            } else if (IsFunction(instruction.code)) {
+                Put(out, instruction.operand);
+            }
+        }
+    }
+
+    Program Program::Deserialize(std::string_view bytes) {
+        // Программа собирается заново тем же сборщиком, что и при компиляции:
+        // он проверяет стек операндов, и испорченные данные не доходят до Execute.
+        ProgramBuilder& builder = ThreadBuilder();
+        Decode(bytes, builder);
+        return builder.Build();
+    }
+
+    void Program::ForEachSerializedReference(std::string_view bytes, const std::function<void(Position)>& on_cell,
+                                             const std::function<void(Range)>& on_range) {
+        struct {
+            const std::function<void(Position)>& on_cell;
+            const std::function<void(Range)>& on_range;
+
+            void PushNumber(double) {}
+            void LoadCell(Position cell) { on_cell(cell); }
+            void LoadRange(Range range, OpCode) { on_range(range); }
+            void Call(OpCode, std::uint32_t) {}
+            void Operation(OpCode) {}
+        } visitor{on_cell, on_range};
+        Decode(bytes, visitor);
+    }
+
+    namespace {
+        bool IsDigit(char ch) {
+            return ch >= '0' && ch <= '9';
+        }
+
+        std::size_t SkipDigits(std::string_view text, std::size_t pos) {
+            while (pos < text.size() && IsDigit(text[pos])) {
+                ++pos;
+            }
+            return pos;
+        }
+
+        // Для чисел вне диапазона double: слишком большое (true) или слишком малое.
+        bool IsOverflow(std::string_view text) {
+            std::size_t exponent_pos = text.find_first_of("eE"sv);
+            std::string_view mantissa = text.substr(0, exponent_pos);
+            std::size_t point = mantissa.find('.');
+            std::string_view int_part = mantissa.substr(0, point);
+            int_part.remove_prefix(std::min(int_part.find_first_not_of('0'), int_part.size()));
+
+            long magnitude = static_cast<long>(int_part.size());
+            if (int_part.empty() && point != std::string_view::npos) {
+                std::string_view fraction = mantissa.substr(point + 1);
+                magnitude = -static_cast<long>(std::min(fraction.find_first_not_of('0'), fraction.size()));
+            }
+
+            if (exponent_pos != std::string_view::npos) {
+                std::string_view exponent_text = text.substr(exponent_pos + 1);
+                bool negative = exponent_text.front() == '-';
+                if (exponent_text.front() == '-' || exponent_text.front() == '+') {
+                    exponent_text.remove_prefix(1);
+                }
+                long exponent = 0;
+                for (char ch : exponent_text) {
+                    exponent = std::min(exponent * 10 + (ch - '0'), 1000000L);
+                }
+                magnitude += negative ? -exponent : exponent;
+            }
+            return magnitude > 0;
+        }
     }  // namespace
+
+    std::size_t MatchNumberLiteral(std::string_view text) {
+        std::size_t end = SkipDigits(text, 0);
+        bool has_int = end != 0;
+        if (end + 1 < text.size() && text[end] == '.' && IsDigit(text[end + 1])) {
+            end = SkipDigits(text, end + 1);
+        } else if (!has_int) {
+            return 0;
+        }
+        if (end < text.size() && (text[end] == 'e' || text[end] == 'E')) {
+            std::size_t exp = end + 1;
+            if (exp < text.size() && (text[exp] == '+' || text[exp] == '-')) {
+                ++exp;
+            }
+            std::size_t exp_end = SkipDigits(text, exp);
+            if (exp_end != exp) {
+                end = exp_end;
+            }
+        }
+        return end;
+    }
+
+    std::optional<double> ParseNumberLiteral(std::string_view text) {
+        double value = 0;
+        auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec == std::errc::result_out_of_range && !IsOverflow(text)) {
+            // istream, как и ANTLR-вариант, превращает исчезающе малые числа в ноль.
+            return 0.0;
+        }
+        if (ec != std::errc{} || ptr != text.data() + text.size()) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    std::optional<std::string> RelativeText(std::string_view text, Position anchor) {
+        std::string result;
+        if (!RelativeText(text, anchor, result)) return std::nullopt;
+        return result;
+    }
+
+    bool RelativeText(std::string_view text, Position anchor, std::string& result) {
+        // Лексемы выделяются так же, как в FormulaTextParser: ссылка - заглавные
+        // буквы и цифры, число - лексема NUMBER, прочее переносится по символу.
+        result.clear();
+        result.reserve(text.size() + 8);
+        std::size_t pos = 0;
+        while (pos < text.size()) {
+            const char ch = text[pos];
+            if (ch >= 'A' && ch <= 'Z') {
+                std::size_t end = pos;
+                while (end < text.size() && text[end] >= 'A' && text[end] <= 'Z') {
+                    ++end;
+                }
+                const std::size_t digits_end = SkipDigits(text, end);
+                if (digits_end == end) {
+                    result.append(text.substr(pos, end - pos));
+                } else {
+                    const Position cell = Position::FromString(text.substr(pos, digits_end - pos));
+                    if (!cell.IsValid()) return false;
+                    // Фигурных скобок в формулах нет, сдвиг не спутать с остальным текстом.
+                    result += '{';
+                    result += std::to_string(cell.row - anchor.row);
+                    result += ',';
+                    result += std::to_string(cell.col - anchor.col);
+                    result += '}';
+                }
+                pos = digits_end;
+            } else if (std::size_t length = MatchNumberLiteral(text.substr(pos)); length > 0) {
+                result.append(text.substr(pos, length));
+                pos += length;
+            } else {
+                result += ch;
+                ++pos;
+            }
+        }
+        return true;
+    }
 }  // namespace ASTImpl
 
+FormulaAST ParseFormulaAST(std::string_view text) {
+    return ASTImpl::FormulaTextParser(text).Parse();
+}
+
 FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(text);
+}
+
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -362,48 +1636,73 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     parser.setErrorHandler(error_handler);
     parser.removeErrorListeners();
 
-    tree::ParseTree* tree = parser.main();
+    tree::ParseTree* tree = nullptr;
+    try {
+        tree = parser.main();
+    } catch (const ParseCancellationException& error) {
+        throw ParsingError("Error when parsing: "s.append(error.what()));
+    }
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.Build());
+}
+
+FormulaAST::FormulaAST(ASTImpl::Program program)
+: program_(std::move(program)) {
+}
+
+double FormulaAST::Execute(const std::function<double(Position)>& get_cell_value) const {
+    return program_.Execute(get_cell_value);
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+double FormulaAST::Execute(const std::function<double(Position)>& get_cell_value,
+                           const RangeReader& get_range_values) const {
+    return program_.Execute(get_cell_value, get_range_values);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-: root_expr_(std::move(root_expr))
-, cells_(std::move(cells)) {
-    cells_.sort();
+const ASTImpl::Program& FormulaAST::GetProgram() const {
+    return program_;
 }
 
-FormulaAST::~FormulaAST() = default;
+std::size_t FormulaAST::GetAllocatedBytes() const {
+    return program_.GetAllocatedBytes();
+}
+
+double FormulaAST::ExecuteRecursive(const std::function<double(Position)>& get_cell_value) const {
+    return ExecuteRecursive(get_cell_value, ASTImpl::ReadNoRanges);
+}
 
-double FormulaAST::Execute(std::function<double(Position)> get_cell_value) const {
-    return root_expr_->Evaluate(get_cell_value);
+double FormulaAST::ExecuteRecursive(const std::function<double(Position)>& get_cell_value,
+                                    const RangeReader& get_range_values) const {
+    const ASTImpl::Tree tree(program_);
+    return tree.Evaluate(tree.Root(), get_cell_value, get_range_values);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
+    for (auto cell : GetCells()) {
         out << cell.ToString() << ' ';
     }
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    const ASTImpl::Tree tree(program_);
+    tree.Print(out, tree.Root());
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    const ASTImpl::Tree tree(program_, offset);
+    tree.PrintFormula(out, tree.Root(), ASTImpl::EP_ATOM);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::Shift(Position offset) {
+    program_.Shift(offset);
 }
 
-std::forward_list<Position>& FormulaAST::GetCells() {
-    return cells_;
+Span<Position> FormulaAST::GetCells() const {
+    return program_.GetCells();
 }
 
-const std::forward_list<Position>& FormulaAST::GetCells() const {
-    return cells_;
+Span<Range> FormulaAST::GetRanges() const {
+    return program_.GetRanges();
 }
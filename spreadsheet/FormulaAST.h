@@ -1,14 +1,129 @@
 #pragma once
 
-#include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Дописывает в values числовые значения ячеек диапазона по строкам.
+// Пустые и текстовые ячейки пропускаются, ошибка в ячейке бросается как FormulaError.
+using RangeReader = std::function<void(Range range, std::vector<double>& values)>;
+// Записывает в values значения count ячеек столбца: first и ниже по строкам.
+// Ошибку k-й ячейки записывает в errors[k], values[k] при этом не важен.
+using ColumnReader = std::function<void(Position first, std::size_t count, double* values,
+                                        std::optional<FormulaError>* errors)>;
 
 namespace ASTImpl {
-    class Expr;
+    enum class OpCode : std::uint8_t {
+        PushNumber,
+        LoadCell,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        // Аргументы агрегатных функций. Каждый аргумент кладёт на стек пару:
+        // частичный итог (сумму, минимум или максимум) и число значений.
+        LoadRange,
+        Argument,
+        // Агрегатные функции, операнд - число аргументов.
+        Sum,
+        Min,
+        Max,
+        Average,
+        Count,
+        // Унарный плюс: вычисление его пропускает, узел нужен для печати формулы.
+        Plus,
+    };
+
+    // Узел формулы. Узлы лежат в постфиксном порядке, поэтому вычисление -
+    // один проход по массиву. Связи между узлами - индексы: поддерево узла
+    // занимает отрезок [first, свой индекс], правый (или единственный) операнд
+    // заканчивается прямо перед узлом, левый - перед первым узлом правого.
+    struct Node {
+        OpCode code;
+        // Для LoadRange - функция, аргументом которой служит диапазон.
+        OpCode function = OpCode::Sum;
+        // Индекс в таблице чисел/ячеек/диапазонов или число аргументов функции.
+        std::uint32_t operand = 0;
+        std::uint32_t first = 0;
+    };
+
+    class ProgramBuilder;
+
+    // Скомпилированная формула в одном блоке памяти: узлы, таблица чисел,
+    // ячейки по возрастанию без повторов и диапазоны без повторов.
+    // Выполняется стековой машиной без рекурсии и виртуальных вызовов.
+    class Program {
+    public:
+        // Дерево формулы в том виде, в каком она записана.
+        Span<Node> GetNodes() const;
+        // Исполняемый код: дерево после свёртки констант.
+        Span<Node> GetCode() const;
+        Span<double> GetConstants() const;
+        Span<Position> GetCells() const;
+        Span<Range> GetRanges() const;
+        // Размер блока программы.
+        std::size_t GetAllocatedBytes() const;
+
+        // Для формул без диапазонов: по отдельным ячейкам нельзя понять, какие
+        // из них агрегатные функции пропускают, поэтому диапазоны читает только
+        // RangeReader. Диапазон в программе - std::logic_error.
+        double Execute(const std::function<double(Position)>& get_cell_value) const;
+        double Execute(const std::function<double(Position)>& get_cell_value,
+                       const RangeReader& get_range_values) const;
+        // Выполняет программу сразу для count формул, ссылки k-й из которых
+        // сдвинуты на k строк вниз: каждая ссылка читается одним столбцом
+        // значений, операции применяются ко всем формулам одним циклом.
+        // В results[k] - значение k-й формулы, в errors[k] - её ошибка;
+        // они те же, что дал бы Execute. Возвращает false, ничего не
+        // вычислив, если в программе есть функции.
+        bool ExecuteRun(std::size_t count, const ColumnReader& read_column, double* results,
+                        std::optional<FormulaError>* errors) const;
+        // Сдвигает все ссылки программы на offset.
+        void Shift(Position offset);
+
+        // Двоичное представление для снимка листа: код операции, за PushNumber
+        // следует число, за LoadCell - строка и столбец ячейки, за LoadRange -
+        // код функции и углы диапазона, за функцией - число аргументов.
+        // Унарный плюс не записывается. Ссылки записываются сдвинутыми на offset.
+        void Serialize(std::string& out, Position offset = {}) const;
+        // Бросает ParsingError, если данные не образуют корректную программу.
+        static Program Deserialize(std::string_view bytes);
+        // Вызывает on_cell и on_range для ссылок программы в представлении
+        // Serialize, не собирая её. Стек операндов при этом не проверяется.
+        // Бросает ParsingError, если данные нельзя разобрать.
+        static void ForEachSerializedReference(std::string_view bytes, const std::function<void(Position)>& on_cell,
+                                               const std::function<void(Range)>& on_range);
+
+    private:
+        friend class ProgramBuilder;
+
+        struct Header;
+
+        struct Deleter {
+            void operator()(Header* header) const;
+        };
+
+        std::unique_ptr<Header, Deleter> block_;
+    };
+
+    // Длина лексемы NUMBER в начале text или 0.
+    std::size_t MatchNumberLiteral(std::string_view text);
+    // Значение лексемы NUMBER; nullopt, если число больше допустимого в double.
+    std::optional<double> ParseNumberLiteral(std::string_view text);
+    // Текст формулы, в котором каждая ссылка на ячейку заменена её сдвигом
+    // относительно anchor, остальное оставлено как есть. У формул, протянутых
+    // по столбцу, он один и тот же. nullopt, если позиция ячейки некорректна.
+    std::optional<std::string> RelativeText(std::string_view text, Position anchor);
+    // То же в result, строка которого переиспользуется; false вместо nullopt.
+    bool RelativeText(std::string_view text, Position anchor, std::string& result);
 }
 
 class ParsingError : public std::runtime_error {
@@ -17,23 +132,38 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
-    ~FormulaAST();
+    explicit FormulaAST(ASTImpl::Program program);
 
-    double Execute(std::function<double(Position)> get_cell_value) const;
+    double Execute(const std::function<double(Position)>& get_cell_value) const;
+    double Execute(const std::function<double(Position)>& get_cell_value,
+                   const RangeReader& get_range_values) const;
+    // Рекурсивный обход дерева, оставлен для сравнения с Execute.
+    // Диапазоны читаются так же, как в Execute.
+    double ExecuteRecursive(const std::function<double(Position)>& get_cell_value) const;
+    double ExecuteRecursive(const std::function<double(Position)>& get_cell_value,
+                            const RangeReader& get_range_values) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
-    std::forward_list<Position>& GetCells();
-    const std::forward_list<Position>& GetCells() const;
+    // Ссылки печатаются сдвинутыми на offset.
+    void PrintFormula(std::ostream& out, Position offset = {}) const;
+    // Сдвигает все ссылки формулы на offset. Формула с ссылками, записанными
+    // относительно её ячейки, - шаблон, общий для формул, протянутых по столбцу.
+    void Shift(Position offset);
+    // Ячейки формулы по возрастанию, без повторов.
+    Span<Position> GetCells() const;
+    // Диапазоны-аргументы функций без повторов, в порядке записи.
+    Span<Range> GetRanges() const;
+    const ASTImpl::Program& GetProgram() const;
+    // Память, занятая формулой.
+    std::size_t GetAllocatedBytes() const;
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    ASTImpl::Program program_;
 };
 
+FormulaAST ParseFormulaAST(std::string_view text);
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+// Разбор через сгенерированный ANTLR парсер - эталон для проверки ParseFormulaAST.
+// Требует antlr4_runtime и Java для генерации парсера; там, где их нет, эталон
+// не собирается и не проверен.
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in);
@@ -0,0 +1,8 @@
+#include "benchmarks.h"
+
+#include <iostream>
+
+int main() {
+    RunBenchmarks(std::cout);
+    return 0;
+}
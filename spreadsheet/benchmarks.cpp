@@ -0,0 +1,854 @@
+#include "benchmarks.h"
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "common.h"
+#include "formula.h"
+#include "heap_counter.h"
+#include "importer.h"
+#include "log_duration.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+    std::string MakeLongExpression(int terms) {
+        std::string expression;
+        for (int i = 0; i < terms; ++i) {
+            if (i > 0) {
+                expression += (i % 2 == 0) ? " + "s : " - "s;
+            }
+            Position pos{i, i % 26};
+            expression += "("s + pos.ToString() + " * "s + std::to_string(i % 7 + 1) + " - -"s
+                          + std::to_string(i % 3 + 1) + ") / 2"s;
+        }
+        return expression;
+    }
+
+    void BenchmarkFormulaExecution(std::ostream& out) {
+        constexpr int TERMS = 64;
+        constexpr int ITERATIONS = 100000;
+
+        FormulaAST ast = ParseFormulaAST(MakeLongExpression(TERMS));
+        const std::function<double(Position)> get_cell_value = [](Position pos) {
+            return static_cast<double>(pos.row % 10 + pos.col);
+        };
+
+        double tree_sum = 0;
+        {
+            LOG_DURATION_STREAM("FormulaAST::ExecuteRecursive, "s + std::to_string(ITERATIONS) + " runs"s, out);
+            for (int i = 0; i < ITERATIONS; ++i) {
+                tree_sum += ast.ExecuteRecursive(get_cell_value);
+            }
+        }
+
+        double program_sum = 0;
+        {
+            LOG_DURATION_STREAM("FormulaAST::Execute, "s + std::to_string(ITERATIONS) + " runs"s, out);
+            for (int i = 0; i < ITERATIONS; ++i) {
+                program_sum += ast.Execute(get_cell_value);
+            }
+        }
+
+        out << "checksum: "s << tree_sum << " / "s << program_sum << std::endl;
+    }
+
+    // Формула с константными множителями, двойным отрицанием и тождествами.
+    void BenchmarkConstantFolding(std::ostream& out) {
+        constexpr int TERMS = 32;
+        constexpr int ITERATIONS = 100000;
+
+        std::string expression;
+        for (int i = 0; i < TERMS; ++i) {
+            const std::string cell = Position{i, i % 26}.ToString();
+            expression += (i > 0 ? " + "s : ""s) + cell + " * (60 * 60 * 24) - -(-"s + cell + ") * 1"s;
+        }
+        const FormulaAST ast = ParseFormulaAST(expression);
+        const std::function<double(Position)> get_cell_value = [](Position pos) {
+            return static_cast<double>(pos.row % 10 + pos.col);
+        };
+
+        double sum = 0;
+        {
+            LOG_DURATION_STREAM("FormulaAST::Execute with constants, "s + std::to_string(ITERATIONS) + " runs"s, out);
+            for (int i = 0; i < ITERATIONS; ++i) {
+                sum += ast.Execute(get_cell_value);
+            }
+        }
+        out << "nodes: "s << ast.GetProgram().GetNodes().size() << ", executed: "s
+            << ast.GetProgram().GetCode().size() << ", checksum: "s << sum << std::endl;
+    }
+
+    void BenchmarkFormulaParsing(std::ostream& out) {
+        constexpr int FORMULAS = 20000;
+
+        std::vector<std::string> expressions;
+        expressions.reserve(FORMULAS);
+        for (int i = 0; i < FORMULAS; ++i) {
+            Position lhs{i % Position::MAX_ROWS, i % 30};
+            Position rhs{(i * 7) % Position::MAX_ROWS, i % 30 + 1};
+            expressions.push_back(lhs.ToString() + "*"s + rhs.ToString() + " + ("s + std::to_string(i) + " - 1.5e2) / 3"s);
+        }
+
+        std::size_t antlr_nodes = 0;
+        {
+            LOG_DURATION_STREAM("ParseFormulaASTWithAntlr, "s + std::to_string(FORMULAS) + " formulas"s, out);
+            for (const std::string& expression : expressions) {
+                std::istringstream in(expression);
+                const FormulaAST ast = ParseFormulaASTWithAntlr(in);
+                antlr_nodes += std::distance(ast.GetCells().begin(), ast.GetCells().end());
+            }
+        }
+
+        std::size_t parser_nodes = 0;
+        {
+            LOG_DURATION_STREAM("ParseFormulaAST, "s + std::to_string(FORMULAS) + " formulas"s, out);
+            for (const std::string& expression : expressions) {
+                const FormulaAST ast = ParseFormulaAST(expression);
+                parser_nodes += std::distance(ast.GetCells().begin(), ast.GetCells().end());
+            }
+        }
+
+        out << "cells: "s << antlr_nodes << " / "s << parser_nodes << std::endl;
+    }
+
+    // Заполнение столбцов одной и той же формулой, как при вставке блока.
+    void BenchmarkBulkLoad(std::ostream& out, std::size_t cache_capacity) {
+        constexpr int ROWS = 16000;
+        const std::vector<std::string> texts = {"=A1*B1"s, "=A1+B1-C1"s, "=(A1+B1)/2"s, "=C1*1.2"s};
+
+        const std::size_t old_capacity = GetFormulaCacheStats().capacity;
+        SetFormulaCacheCapacity(cache_capacity);
+        ClearFormulaCache();
+
+        auto sheet = CreateSheet();
+        {
+            LOG_DURATION_STREAM("SetCell, "s + std::to_string(ROWS * texts.size()) + " formulas, cache capacity "s
+                                + std::to_string(cache_capacity), out);
+            for (int row = 1; row < ROWS + 1; ++row) {
+                for (std::size_t col = 0; col < texts.size(); ++col) {
+                    sheet->SetCell({row, static_cast<int>(col) + 3}, texts[col]);
+                }
+            }
+        }
+
+        FormulaCacheStats stats = GetFormulaCacheStats();
+        out << "cache hits: "s << stats.hits << ", misses: "s << stats.misses << std::endl;
+
+        SetFormulaCacheCapacity(old_capacity);
+        ClearFormulaCache();
+    }
+
+    void BenchmarkPrint(std::ostream& out) {
+        constexpr int ROWS = 4000;
+        constexpr int COLS = 500;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < ROWS; row += 3) {
+            for (int col = row % 7; col < COLS; col += 11) {
+                sheet->SetCell({row, col}, (col % 2 == 0) ? std::to_string(row * col) : "=1/"s + std::to_string(col));
+            }
+        }
+
+        std::ostringstream values;
+        {
+            LOG_DURATION_STREAM("PrintValues, sparse "s + std::to_string(ROWS) + "x"s + std::to_string(COLS), out);
+            sheet->PrintValues(values);
+        }
+        std::ostringstream texts;
+        {
+            LOG_DURATION_STREAM("PrintTexts, sparse "s + std::to_string(ROWS) + "x"s + std::to_string(COLS), out);
+            sheet->PrintTexts(texts);
+        }
+        out << "bytes: "s << values.str().size() << " / "s << texts.str().size() << std::endl;
+    }
+
+    // Каждая новая формула проверяется на циклы обходом всего, от чего она зависит.
+    void BenchmarkCycleCheck(std::ostream& out) {
+        {
+            constexpr int LENGTH = 4000;
+            auto sheet = CreateSheet();
+            sheet->SetCell({0, 0}, "1"s);
+            LOG_DURATION_STREAM("Deep chain, "s + std::to_string(LENGTH) + " formulas set top-down"s, out);
+            for (int row = 1; row < LENGTH; ++row) {
+                sheet->SetCell({row, 0}, "="s + Position{row - 1, 0}.ToString() + "+1"s);
+            }
+        }
+        {
+            constexpr int INPUTS = 200;
+            constexpr int MIDDLE = 4000;
+            constexpr int TOP = 400;
+            constexpr int FAN_IN = 20;
+            auto sheet = CreateSheet();
+            for (int row = 0; row < INPUTS; ++row) {
+                sheet->SetCell({row, 0}, std::to_string(row));
+            }
+            LOG_DURATION_STREAM("Wide graph, "s + std::to_string(MIDDLE + TOP) + " formulas with fan-in "s
+                                + std::to_string(FAN_IN), out);
+            for (int row = 0; row < MIDDLE; ++row) {
+                std::string text = "=0"s;
+                for (int i = 0; i < FAN_IN; ++i) {
+                    text += "+"s + Position{(row * 7 + i * 13) % INPUTS, 0}.ToString();
+                }
+                sheet->SetCell({row, 1}, text);
+            }
+            for (int row = 0; row < TOP; ++row) {
+                std::string text = "=0"s;
+                for (int i = 0; i < FAN_IN; ++i) {
+                    text += "+"s + Position{(row * 11 + i * 17) % MIDDLE, 1}.ToString();
+                }
+                sheet->SetCell({row, 2}, text);
+            }
+        }
+    }
+
+    // Накопительный итог в столбце A складывает значения столбца B, которые
+    // вставляются формулами, ссылающимися на более новые ячейки столбца C.
+    // Каждая такая правка по отдельности передвигает в топологическом порядке
+    // весь хвост итога, а пакет упорядочивает затронутые ячейки один раз.
+    void BenchmarkBatchPaste(std::ostream& out) {
+        constexpr int ROWS = 4000;
+
+        for (bool batch : {false, true}) {
+            auto sheet = CreateSheet();
+            sheet->SetCell({0, 0}, "0"s);
+            for (int row = 1; row < ROWS; ++row) {
+                sheet->SetCell({row, 0}, "="s + Position{row - 1, 0}.ToString() + "+"s + Position{row, 1}.ToString());
+            }
+            for (int row = 1; row < ROWS; ++row) {
+                sheet->SetCell({row, 2}, "="s + std::to_string(row));
+            }
+
+            LOG_DURATION_STREAM("Paste "s + std::to_string(ROWS - 1) + " formulas under a running total"s
+                                + (batch ? " in one batch"s : " one by one"s), out);
+            if (batch) sheet->BeginBatch();
+            for (int row = 1; row < ROWS; ++row) {
+                sheet->SetCell({row, 1}, "="s + Position{row, 2}.ToString() + "*2"s);
+            }
+            if (batch) sheet->CommitBatch();
+        }
+    }
+
+    // Пересчёт листа, в котором каждая строка зависит от предыдущей,
+    // после изменения первой строки.
+    void BenchmarkParallelRecalculate(std::ostream& out) {
+        constexpr int ROWS = 200;
+        constexpr int COLS = 500;
+
+        auto sheet = CreateSheet();
+        for (int col = 0; col < COLS; ++col) {
+            sheet->SetCell({0, col}, std::to_string(col));
+        }
+        for (int row = 1; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                Position left{row - 1, (col + COLS - 1) % COLS};
+                Position up{row - 1, col};
+                Position right{row - 1, (col + 1) % COLS};
+                sheet->SetCell({row, col}, "=("s + left.ToString() + "+"s + up.ToString() + "*2+"s
+                               + right.ToString() + ")/4"s);
+            }
+        }
+
+        const unsigned max_threads = std::max(4u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+            for (int col = 0; col < COLS; ++col) {
+                sheet->SetCell({0, col}, std::to_string(col + threads));
+            }
+            LOG_DURATION_STREAM("Recalculate, "s + std::to_string(ROWS * COLS) + " cells, "s
+                                + std::to_string(threads) + " threads"s, out);
+            static_cast<Sheet&>(*sheet).Recalculate(threads);
+        }
+    }
+
+    // Столбцы протянутых формул пересчитываются сериями по шаблону.
+    void BenchmarkColumnRecalculate(std::ostream& out) {
+        constexpr int ROWS = Position::MAX_ROWS;
+        constexpr int COLS = 8;
+        constexpr int ROUNDS = 5;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string suffix = std::to_string(row + 1);
+            sheet->SetCell({row, 0}, std::to_string(row));
+            sheet->SetCell({row, 1}, std::to_string(row % 7 + 1));
+            for (int col = 2; col < 2 + COLS; ++col) {
+                sheet->SetCell({row, col}, "=(A"s + suffix + "*"s + std::to_string(col) + "-B"s + suffix + ")/(B"s
+                               + suffix + "+A"s + suffix + ")"s);
+            }
+        }
+        static_cast<Sheet&>(*sheet).Recalculate();
+
+        double checksum = 0;
+        std::chrono::steady_clock::duration total{};
+        for (int round = 0; round < ROUNDS; ++round) {
+            for (int row = 0; row < ROWS; ++row) {
+                sheet->SetCell({row, 1}, std::to_string((row + round) % 7 + 1));
+            }
+            const auto start = std::chrono::steady_clock::now();
+            static_cast<Sheet&>(*sheet).Recalculate();
+            total += std::chrono::steady_clock::now() - start;
+            checksum += std::get<double>(sheet->GetCell({ROWS - 1, 2 + COLS - 1})->GetValue());
+        }
+        out << "Recalculate, "s << ROWS * COLS << " filled-down formulas: "s
+            << std::chrono::duration<double, std::milli>(total).count() / ROUNDS << " ms, checksum: "s << checksum
+            << std::endl;
+    }
+
+    // Сумма столбца одной функцией по диапазону и цепочкой сложений.
+    void BenchmarkRangeAggregate(std::ostream& out) {
+        constexpr int ROWS = 10000;
+        constexpr int ITERATIONS = 200;
+
+        std::string chain;
+        for (int row = 0; row < ROWS; ++row) {
+            if (row > 0) chain += '+';
+            chain += Position{row, 0}.ToString();
+        }
+        const std::string range = "SUM(A1:"s + Position{ROWS - 1, 0}.ToString() + ")"s;
+        const std::pair<std::string, std::string> cases[] = {
+            {"A1+A2+...+"s + Position{ROWS - 1, 0}.ToString(), chain},
+            {range, range},
+        };
+
+        for (const auto& [name, expression] : cases) {
+            auto sheet = CreateSheet();
+            for (int row = 0; row < ROWS; ++row) {
+                sheet->SetCell({row, 0}, std::to_string(row % 100));
+            }
+            {
+                LOG_DURATION_STREAM("Set ="s + name, out);
+                sheet->SetCell({0, 1}, "="s + expression);
+            }
+
+            double checksum = 0;
+            {
+                LOG_DURATION_STREAM("Recalculate ="s + name + ", "s + std::to_string(ITERATIONS) + " edits"s, out);
+                for (int i = 0; i < ITERATIONS; ++i) {
+                    sheet->SetCell({0, 0}, std::to_string(i));
+                    checksum += std::get<double>(sheet->GetCell({0, 1})->GetValue());
+                }
+            }
+            out << "checksum: "s << checksum << std::endl;
+        }
+
+        // Те же формулы без листа: значения берутся из массива, и остаётся
+        // разница между стековой машиной и свёрткой диапазона.
+        std::vector<double> column(ROWS);
+        for (int row = 0; row < ROWS; ++row) {
+            column[row] = row % 100;
+        }
+        const std::function<double(Position)> get_cell_value = [&column](Position pos) {
+            return column[pos.row];
+        };
+        const RangeReader get_range_values = [&column](Range range, std::vector<double>& values) {
+            values.insert(values.end(), column.begin() + range.first.row, column.begin() + range.last.row + 1);
+        };
+        for (const auto& [name, expression] : cases) {
+            const FormulaAST ast = ParseFormulaAST(expression);
+            double checksum = 0;
+            {
+                LOG_DURATION_STREAM("FormulaAST::Execute "s + name + ", "s + std::to_string(ITERATIONS * 10) + " runs"s, out);
+                for (int i = 0; i < ITERATIONS * 10; ++i) {
+                    checksum += ast.Execute(get_cell_value, get_range_values);
+                }
+            }
+            out << "checksum: "s << checksum << std::endl;
+        }
+    }
+
+    void BenchmarkImport(std::ostream& out) {
+        constexpr int ROWS = 4000;
+        constexpr int COLS = 40;
+
+        std::string table;
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                if (col > 0) table += '\t';
+                if (col % 4 == 0 || row == 0) {
+                    table += std::to_string(row * COLS + col);
+                } else {
+                    table += "=("s + Position{row - 1, col}.ToString() + "+"s + Position{row, col - 1}.ToString()
+                             + ")/"s + std::to_string(col % 7 + 2);
+                }
+            }
+            table += '\n';
+        }
+
+        // Кэш формул не должен отдавать разобранное в предыдущем замере.
+        const std::size_t old_capacity = GetFormulaCacheStats().capacity;
+        SetFormulaCacheCapacity(0);
+        const unsigned max_threads = std::max(4u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+            auto sheet = CreateSheet();
+            std::istringstream input(table);
+            LogDuration duration("ImportTexts, "s + std::to_string(threads) + " threads"s, out);
+            const ImportStats stats = ImportTexts(static_cast<Sheet&>(*sheet), input, TextTableFormat::TSV, threads);
+            const double seconds = duration.ElapsedMs() / 1000;
+            out << stats.bytes / seconds / (1 << 20) << " MB/s, "s << stats.cells / seconds << " cells/s"s << std::endl;
+        }
+        SetFormulaCacheCapacity(old_capacity);
+    }
+
+    // Запуск с готовым листом: из текстов ячеек и из двоичного снимка.
+    void BenchmarkSnapshot(std::ostream& out) {
+        constexpr int ROWS = 2000;
+        constexpr int COLS = 50;
+
+        auto source = CreateSheet();
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                source->SetCell({row, col}, row == 0 ? std::to_string(col)
+                                                     : "="s + Position{row - 1, col}.ToString() + "*0.5+"s
+                                                       + Position{row - 1, (col + 1) % COLS}.ToString());
+            }
+        }
+        static_cast<Sheet&>(*source).Recalculate();
+        std::ostringstream texts;
+        source->PrintTexts(texts);
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_snapshot_bench.bin").string();
+        {
+            std::ofstream output(path, std::ios::binary);
+            LOG_DURATION_STREAM("SaveSnapshot, "s + std::to_string(ROWS * COLS) + " cells"s, out);
+            static_cast<Sheet&>(*source).SaveSnapshot(output);
+        }
+        out << "snapshot bytes: "s << std::filesystem::file_size(path) << ", texts bytes: "s << texts.str().size()
+            << std::endl;
+
+        const Position last{ROWS - 1, COLS - 1};
+        CellInterface::Value value;
+        {
+            LOG_DURATION_STREAM("Warm start from texts: import and recalculate"s, out);
+            auto sheet = CreateSheet();
+            std::istringstream input(texts.str());
+            ImportTexts(static_cast<Sheet&>(*sheet), input);
+            static_cast<Sheet&>(*sheet).Recalculate();
+            value = sheet->GetCell(last)->GetValue();
+        }
+        {
+            LOG_DURATION_STREAM("Warm start from snapshot with saved values"s, out);
+            std::unique_ptr<Sheet> sheet = Sheet::LoadSnapshot(path);
+            value = sheet->GetCell(last)->GetValue();
+        }
+        {
+            LOG_DURATION_STREAM("Warm start from snapshot with recalculation"s, out);
+            std::unique_ptr<Sheet> sheet = Sheet::LoadSnapshot(path, SnapshotValues::RECALCULATE);
+            sheet->Recalculate();
+            value = sheet->GetCell(last)->GetValue();
+        }
+        std::filesystem::remove(path);
+    }
+
+    // Память кучи на ячейку листа, в котором половина ячеек - числа,
+    // а половина - формулы с двумя ссылками.
+    void BenchmarkMemoryPerCell(std::ostream& out) {
+        constexpr int ROWS = 10000;
+        constexpr int COLS = 10;
+
+        const std::size_t before = live_heap_bytes.load();
+        auto sheet = CreateSheet();
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                if (col % 2 == 0) {
+                    sheet->SetCell({row, col}, std::to_string(row + col));
+                } else {
+                    sheet->SetCell({row, col}, "="s + Position{row, col - 1}.ToString() + "+"s
+                                   + Position{(row + 1) % ROWS, col - 1}.ToString());
+                }
+            }
+        }
+        static_cast<Sheet&>(*sheet).Recalculate();
+        ClearFormulaCache();
+        const std::size_t used = live_heap_bytes.load() - before;
+        out << "Heap per cell, "s << ROWS * COLS << " cells (half formulas): "s
+            << static_cast<double>(used) / (ROWS * COLS) << " bytes, sizeof(Cell) = "s << sizeof(Cell) << std::endl;
+    }
+
+    // Столбец одной и той же формулы, протянутой вниз: =A1*B1, =A2*B2, ...
+    void BenchmarkFilledColumn(std::ostream& out) {
+        constexpr int ROWS = Position::MAX_ROWS;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < ROWS; ++row) {
+            sheet->SetCell({row, 0}, std::to_string(row));
+            sheet->SetCell({row, 1}, "2");
+        }
+        ClearFormulaCache();
+        const std::size_t before = live_heap_bytes.load();
+        {
+            LOG_DURATION_STREAM("SetCell, "s + std::to_string(ROWS) + " filled-down formulas"s, out);
+            for (int row = 0; row < ROWS; ++row) {
+                const std::string suffix = std::to_string(row + 1);
+                sheet->SetCell({row, 2}, "=A"s + suffix + "*B"s + suffix);
+            }
+        }
+        const FormulaCacheStats stats = GetFormulaCacheStats();
+        ClearFormulaCache();
+        const std::size_t used = live_heap_bytes.load() - before;
+        double checksum = 0;
+        for (int row = 0; row < ROWS; ++row) {
+            checksum += std::get<double>(sheet->GetCell({row, 2})->GetValue());
+        }
+        out << "heap per formula cell: "s << static_cast<double>(used) / ROWS << " bytes, "s << stats.misses
+            << " formulas parsed, checksum: "s << checksum << std::endl;
+
+        // Сами формулы, без ячеек и связей между ними.
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        formulas.reserve(ROWS);
+        const std::size_t formulas_before = live_heap_bytes.load();
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string suffix = std::to_string(row + 1);
+            formulas.push_back(ParseFormula("A"s + suffix + "*B"s + suffix, Position{row, 2}));
+        }
+        ClearFormulaCache();
+        out << "heap per filled-down formula: "s
+            << static_cast<double>(live_heap_bytes.load() - formulas_before) / ROWS << " bytes"s << std::endl;
+    }
+
+    // Клиент присылает строки целиком, и почти все записи повторяют текст ячеек.
+    void BenchmarkRedundantWrites(std::ostream& out) {
+        constexpr int ROWS = Position::MAX_ROWS;
+
+        auto sheet = CreateSheet();
+        std::vector<std::pair<Position, std::string>> rows;
+        rows.reserve(3 * ROWS);
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string suffix = std::to_string(row + 1);
+            rows.push_back({{row, 0}, "item "s + suffix});
+            rows.push_back({{row, 1}, "'"s + suffix});
+            rows.push_back({{row, 2}, "=SUM(B"s + suffix + ":B"s + std::to_string(ROWS) + ")*(B"s + suffix + "+1)"s});
+        }
+        for (const auto& [pos, text] : rows) {
+            sheet->SetCell(pos, text);
+        }
+        // Повторная запись формулы сравнивает её текст со ссылками относительно
+        // ячейки с текстом шаблона, не разбирая и не печатая формулу.
+        for (const char* pass : {" (first)", ""}) {
+            LOG_DURATION_STREAM("SetCell, "s + std::to_string(rows.size()) + " redundant writes"s + pass, out);
+            for (const auto& [pos, text] : rows) {
+                sheet->SetCell(pos, text);
+            }
+        }
+        {
+            LOG_DURATION_STREAM("Batch of "s + std::to_string(rows.size()) + " redundant writes"s, out);
+            sheet->BeginBatch();
+            for (const auto& [pos, text] : rows) {
+                sheet->SetCell(pos, text);
+            }
+            sheet->CommitBatch();
+        }
+        out << "text: "s << sheet->GetCell({ROWS - 1, 2})->GetText() << std::endl;
+    }
+
+    // Формула со ссылкой на диапазон: память и время правок внутри
+    // диапазона не должны зависеть от его длины.
+    void BenchmarkRangeDependencies(std::ostream& out) {
+        constexpr int EDITS = 1000;
+
+        for (int rows : {100, 1000, Position::MAX_ROWS}) {
+            auto sheet = CreateSheet();
+            sheet->SetCell({0, 0}, "x");
+            ClearFormulaCache();
+            const std::string formula = "=SUM(A1:"s + Position{rows - 1, 0}.ToString() + ")"s;
+            const std::size_t before = live_heap_bytes.load();
+            sheet->SetCell({0, 1}, formula);
+            ClearFormulaCache();
+            const std::size_t used = live_heap_bytes.load() - before;
+
+            double checksum = 0;
+            {
+                LOG_DURATION_STREAM(formula + ", "s + std::to_string(EDITS) + " edits inside"s, out);
+                for (int i = 0; i < EDITS; ++i) {
+                    sheet->SetCell({i % 100, 0}, std::to_string(i));
+                    checksum += std::get<double>(sheet->GetCell({0, 1})->GetValue());
+                }
+            }
+            out << formula << ": "s << used << " heap bytes, checksum: "s << checksum << std::endl;
+        }
+    }
+
+    // Числовые константы в столбцах: память на число и пересчёт формулы,
+    // читающей их диапазоном, до и после переноса чисел в объекты ячеек.
+    void BenchmarkNumericColumns(std::ostream& out) {
+        constexpr int ROWS = 10000;
+        constexpr int COLS = 10;
+        constexpr int EDITS = 200;
+        const std::string formula = "=SUM(A1:"s + Position{ROWS - 1, COLS - 1}.ToString() + ")"s;
+
+        {
+            // Разреженные числа: по одному на несколько блоков столбца.
+            constexpr int STEP = 97;
+            auto sparse = CreateSheet();
+            const std::size_t start = live_heap_bytes.load();
+            int count = 0;
+            for (int row = 0; row < Position::MAX_ROWS; row += STEP) {
+                for (int col = 0; col < COLS; ++col) {
+                    sparse->SetCell({row, col * STEP}, std::to_string(row + col));
+                    ++count;
+                }
+            }
+            out << "Heap per numeric cell, sparse numeric columns: "s
+                << static_cast<double>(live_heap_bytes.load() - start) / count << " bytes"s << std::endl;
+        }
+
+        auto sheet = CreateSheet();
+        std::size_t before = live_heap_bytes.load();
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                sheet->SetCell({row, col}, std::to_string(row % 1000 + col));
+            }
+        }
+        int edit = 0;
+        for (const char* layout : {"numeric columns", "Cell objects"}) {
+            const std::size_t used = live_heap_bytes.load() - before;
+            out << "Heap per numeric cell, "s << layout << ": "s << static_cast<double>(used) / (ROWS * COLS)
+                << " bytes"s << std::endl;
+
+            sheet->SetCell({0, COLS}, formula);
+            double checksum = 0;
+            {
+                LOG_DURATION_STREAM(formula + " over "s + layout + ", "s + std::to_string(EDITS) + " edits"s, out);
+                for (int i = 0; i < EDITS; ++i) {
+                    sheet->SetCell({i % ROWS, 0}, std::to_string(++edit));
+                    checksum += std::get<double>(sheet->GetCell({0, COLS})->GetValue());
+                }
+            }
+            out << "checksum: "s << checksum << std::endl;
+
+            // Запись с ведущим нулём хранится текстом в объекте ячейки,
+            // а формулы читают её тем же числом.
+            sheet->ClearCell({0, COLS});
+            ClearFormulaCache();
+            for (int row = 0; row < ROWS; ++row) {
+                for (int col = 0; col < COLS; ++col) {
+                    sheet->SetCell({row, col}, "0"s + std::to_string(row % 1000 + col));
+                }
+            }
+        }
+    }
+
+    // Поток, отбрасывающий вывод: замер печати без роста строки.
+    class NullBuffer : public std::streambuf {
+    protected:
+        int overflow(int c) override {
+            return c;
+        }
+
+        std::streamsize xsputn(const char*, std::streamsize count) override {
+            return count;
+        }
+    };
+
+    // Чтение значений копией и представлением: время и число выделений кучи.
+    void BenchmarkValueReads(std::ostream& out) {
+        constexpr int ROWS = 10000;
+        constexpr int READS = 20;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < ROWS; ++row) {
+            // Длинный текст и число с ведущими нулями хранятся строками.
+            sheet->SetCell({row, 0}, "text longer than short string "s + std::to_string(row));
+            sheet->SetCell({row, 1}, "00"s + std::to_string(row % 1000));
+            sheet->SetCell({row, 2}, "=B"s + std::to_string(row + 1) + "*2"s);
+        }
+        std::vector<const CellInterface*> cells;
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < 3; ++col) {
+                cells.push_back(sheet->GetCell({row, col}));
+            }
+        }
+
+        // Выделения считаются внутри замера, без строк самого замера.
+        std::size_t before = 0;
+        std::size_t allocations = 0;
+        auto report = [&out, &allocations](const std::string& name, double checksum) {
+            out << name << ": "s << allocations << " allocations, checksum: "s << checksum << std::endl;
+        };
+
+        std::size_t checksum = 0;
+        {
+            LOG_DURATION_STREAM("GetValue, "s + std::to_string(cells.size() * READS) + " reads"s, out);
+            before = heap_allocations.load();
+            for (int i = 0; i < READS; ++i) {
+                for (const CellInterface* cell : cells) {
+                    const CellInterface::Value value = cell->GetValue();
+                    if (const auto* text = std::get_if<std::string>(&value)) checksum += text->size();
+                }
+            }
+            allocations = heap_allocations.load() - before;
+        }
+        report("GetValue"s, checksum);
+
+        checksum = 0;
+        {
+            LOG_DURATION_STREAM("GetValueView, "s + std::to_string(cells.size() * READS) + " reads"s, out);
+            before = heap_allocations.load();
+            for (int i = 0; i < READS; ++i) {
+                for (const CellInterface* cell : cells) {
+                    const CellInterface::ValueView value = cell->GetValueView();
+                    if (const auto* text = std::get_if<std::string_view>(&value)) checksum += text->size();
+                }
+            }
+            allocations = heap_allocations.load() - before;
+        }
+        report("GetValueView"s, checksum);
+
+        NullBuffer null_buffer;
+        std::ostream null_stream(&null_buffer);
+        {
+            LOG_DURATION_STREAM("PrintValues x"s + std::to_string(READS), out);
+            before = heap_allocations.load();
+            for (int i = 0; i < READS; ++i) {
+                sheet->PrintValues(null_stream);
+            }
+            allocations = heap_allocations.load() - before;
+        }
+        report("PrintValues"s, 0);
+
+        // Формула, читающая числа из текста, вычисляется без выделений.
+        auto formula = ParseFormula("B1+B2*B3-B4");
+        double sum = 0;
+        {
+            LOG_DURATION_STREAM("Evaluate over text cells x"s + std::to_string(ROWS), out);
+            before = heap_allocations.load();
+            for (int i = 0; i < ROWS; ++i) {
+                sum += std::get<double>(formula->Evaluate(*sheet));
+            }
+            allocations = heap_allocations.load() - before;
+        }
+        report("Evaluate"s, sum);
+    }
+
+    // Резидентная память процесса в байтах или 0, если её не узнать (нужен /proc).
+    std::size_t ResidentBytes() {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.rfind("VmRSS:"s, 0) == 0) {
+                return std::stoull(line.substr(6)) * 1024;
+            }
+        }
+        return 0;
+    }
+
+    // Память скомпилированной формулы: байты кучи и блоки, которые остаются
+    // за формулой после разбора, и выделения на один разбор.
+    void BenchmarkFormulaMemory(std::ostream& out) {
+        constexpr int FORMULAS = 20000;
+
+        const std::size_t old_capacity = GetFormulaCacheStats().capacity;
+        SetFormulaCacheCapacity(0);
+
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        formulas.reserve(FORMULAS);
+        const std::size_t heap_before = live_heap_bytes.load();
+        const std::size_t blocks_before = live_heap_blocks.load();
+        const std::size_t allocations_before = heap_allocations.load();
+        {
+            LOG_DURATION_STREAM("ParseFormula, "s + std::to_string(FORMULAS) + " formulas"s, out);
+            for (int i = 0; i < FORMULAS; ++i) {
+                const Position pos{i % Position::MAX_ROWS, i % 26};
+                formulas.push_back(ParseFormula(pos.ToString() + "*"s + std::to_string(i) + "+"s
+                                                + Position{i % 100, 1}.ToString() + "/(1-"s + pos.ToString()
+                                                + ")+SUM(A1:"s + Position{i % 50, 3}.ToString() + ")"s));
+            }
+        }
+        out << "per formula: "s << static_cast<double>(live_heap_bytes.load() - heap_before) / FORMULAS
+            << " heap bytes in "s << static_cast<double>(live_heap_blocks.load() - blocks_before) / FORMULAS
+            << " blocks, "s << static_cast<double>(heap_allocations.load() - allocations_before) / FORMULAS
+            << " allocations to parse"s << std::endl;
+        formulas.clear();
+
+        SetFormulaCacheCapacity(old_capacity);
+        ClearFormulaCache();
+    }
+
+    // Создание и удаление ячеек: выделения кучи, занятая память и RSS на ячейку.
+    void BenchmarkCellAllocation(std::ostream& out) {
+        constexpr int ROWS = 10000;
+        constexpr int COLS = 20;
+        constexpr double CELLS = ROWS * COLS;
+
+        const std::size_t old_capacity = GetFormulaCacheStats().capacity;
+        SetFormulaCacheCapacity(0);
+
+        const std::size_t rss_before = ResidentBytes();
+        const std::size_t heap_before = live_heap_bytes.load();
+        const std::size_t allocations_before = heap_allocations.load();
+        auto sheet = CreateSheet();
+        {
+            LOG_DURATION_STREAM("SetCell, "s + std::to_string(ROWS * COLS) + " text and formula cells"s, out);
+            for (int row = 0; row < ROWS; ++row) {
+                for (int col = 0; col < COLS; ++col) {
+                    if (col % 2 == 0) {
+                        sheet->SetCell({row, col}, "item "s + std::to_string(row));
+                    } else {
+                        sheet->SetCell({row, col}, "="s + Position{row, col - 1}.ToString() + "*"s
+                                       + std::to_string(row % 97) + "+1"s);
+                    }
+                }
+            }
+        }
+        out << "per cell: "s << (heap_allocations.load() - allocations_before) / CELLS << " allocations, "s
+            << (live_heap_bytes.load() - heap_before) / CELLS << " heap bytes, "s
+            << (static_cast<double>(ResidentBytes()) - rss_before) / CELLS << " RSS bytes"s << std::endl;
+
+        {
+            LOG_DURATION_STREAM("ClearCell, "s + std::to_string(ROWS * COLS) + " cells"s, out);
+            for (int row = 0; row < ROWS; ++row) {
+                for (int col = 0; col < COLS; ++col) {
+                    sheet->ClearCell({row, col});
+                }
+            }
+        }
+        out << "after clear: "s << static_cast<double>(live_heap_bytes.load()) - heap_before << " heap bytes, "s
+            << (static_cast<double>(ResidentBytes()) - rss_before) / CELLS << " RSS bytes per cell"s << std::endl;
+        sheet.reset();
+
+        SetFormulaCacheCapacity(old_capacity);
+        ClearFormulaCache();
+    }
+
+}  // namespace
+
+void RunBenchmarks(std::ostream& out) {
+    // Первым, пока куча процесса не выросла от других замеров: иначе RSS не показателен.
+    BenchmarkCellAllocation(out);
+    BenchmarkMemoryPerCell(out);
+    BenchmarkFilledColumn(out);
+    BenchmarkFormulaExecution(out);
+    BenchmarkConstantFolding(out);
+    BenchmarkFormulaParsing(out);
+    BenchmarkFormulaMemory(out);
+    BenchmarkBulkLoad(out, 0);
+    BenchmarkBulkLoad(out, 1 << 14);
+    BenchmarkPrint(out);
+    BenchmarkCycleCheck(out);
+    BenchmarkBatchPaste(out);
+    BenchmarkRedundantWrites(out);
+    BenchmarkParallelRecalculate(out);
+    BenchmarkColumnRecalculate(out);
+    BenchmarkRangeAggregate(out);
+    BenchmarkRangeDependencies(out);
+    BenchmarkNumericColumns(out);
+    BenchmarkValueReads(out);
+    BenchmarkImport(out);
+    BenchmarkSnapshot(out);
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <iosfwd>
+
+// Замеры производительности, запускаются отдельной программой spreadsheet_bench.
+void RunBenchmarks(std::ostream& out);
@@ -1,29 +1,55 @@
 #include "cell.h"
+#include "sheet.h"
+#include <cmath>
+#include <limits>
 #include <string>
+#include <type_traits>
 
 using namespace std::literals;
 
 
-Cell::Cell(SheetInterface& sheet, Position position)
-: sheet_(sheet), impl_(std::make_unique<EmptyImpl>()), position_(position) {}
+Cell::Cell(Sheet& sheet, Position position)
+: sheet_(sheet), impl_(new (sheet.ImplPool()) EmptyImpl()), position_(position) {
+    sheet_.PlaceFirst(*this);
+}
 
 Cell::~Cell() = default;
 
+namespace {
+
+bool IsFormulaText(const std::string& text) {
+    return !text.empty() && text.front() == FORMULA_SIGN && text.size() != 1;
+}
+
+// Значение текстовой ячейки: текст без экранирующего знака.
+std::string_view UnescapedText(std::string_view text) {
+    if (text.front() == ESCAPE_SIGN) text.remove_prefix(1);
+    return text;
+}
+
+}  // namespace
+
+std::unique_ptr<CellImpl> Cell::MakeImpl(SlabPool& pool, const std::string& text, Position position) {
+    if (IsFormulaText(text)) return std::unique_ptr<CellImpl>(new (pool) FormulaImpl(text.substr(1), position));
+    if (text.empty()) return std::unique_ptr<CellImpl>(new (pool) EmptyImpl());
+    return std::unique_ptr<CellImpl>(new (pool) TextImpl(text));
+}
+
 void Cell::Set(const std::string& text) {
-    if (text.front() == FORMULA_SIGN && text.size() != 1) {
-        std::unique_ptr<FormulaImpl> impl_tmp = std::make_unique<FormulaImpl>(text.substr(1));
-        const std::vector<Position>& positions = impl_tmp->GetReferencedCells();
+    if (IsFormulaText(text)) {
+        std::unique_ptr<FormulaImpl> impl_tmp(new (sheet_.ImplPool()) FormulaImpl(text.substr(1), position_));
+        const ShiftedSpan<Position> positions = impl_tmp->GetReferencedCells();
         PositionsSet cells_referring_by_me_tmp(positions.begin(), positions.end());
-        if (HasCircularDependencies(cells_referring_by_me_tmp)) throw CircularDependencyException("Circular dependency was found"s);
-        UpdateDependencies(std::move(cells_referring_by_me_tmp));
-        impl_ = std::move(impl_tmp);
-    } else {
-        if (text.empty()) {
-            impl_ = std::make_unique<EmptyImpl>();
-        } else {
-            impl_ = std::make_unique<TextImpl>(text);
+        // От ячейки без зависимых ничего не вычисляется, её можно поставить
+        // в конец порядка - тогда ссылки на уже существующие ячейки его не нарушают.
+        if (!sheet_.HasDependents(*this)) sheet_.PlaceLast(*this);
+        if (HasCircularDependencies(cells_referring_by_me_tmp, impl_tmp->GetReferencedRanges())) {
+            throw CircularDependencyException("Circular dependency was found"s);
         }
-        UpdateDependencies(PositionsSet{});
+        UpdateDependencies(std::move(impl_tmp), std::move(cells_referring_by_me_tmp));
+        sheet_.MarkDirty(*this);
+    } else {
+        UpdateDependencies(MakeImpl(sheet_.ImplPool(), text, position_), PositionsSet{});
     }
 }
 
@@ -32,121 +58,220 @@ void Cell::Clear() {
 }
 
 Cell::Value Cell::GetValue() const {
+    if (IsStale()) {
+        sheet_.Compute(*this);
+    }
     return impl_->GetValue(sheet_);
 }
 
-std::string Cell::GetText() const {
+Cell::ValueView Cell::GetValueView() const {
+    if (IsStale()) {
+        sheet_.Compute(*this);
+    }
+    return impl_->GetValueView(sheet_);
+}
+
+std::optional<double> Cell::GetTextNumber() const {
+    return impl_->GetTextNumber();
+}
+
+std::string_view Cell::GetText() const {
     return impl_->GetText();
 }
 
-void Cell::UpdateDependencies(PositionsSet&& cells_referring_by_me_tmp) {
+bool Cell::HasText(std::string_view text) const {
+    return impl_->HasText(text);
+}
+
+void Cell::UpdateDependencies(std::unique_ptr<CellImpl> impl, PositionsSet&& cells_referring_by_me_tmp) {
     InvalidateCache();
     RemoveDependencies();
+    impl_ = std::move(impl);
     cells_referring_by_me_ = std::move(cells_referring_by_me_tmp);
     for (const Position& pos : cells_referring_by_me_) {
-        if (sheet_.GetCell(pos) == nullptr) sheet_.SetCell(pos, ""s);
+        sheet_.ReferencedCell(pos);
     }
     AddDependencies();
 }
 
 void Cell::RemoveDependencies() {
     for (Position position : cells_referring_by_me_) {
-        Cell* cell = static_cast<Cell*>(sheet_.GetCell(position));
-        if (cell != nullptr) cell->cells_referring_me_.erase(position_);
+        Cell* cell = sheet_.FindCell(position);
+        if (cell != nullptr) cell->cells_referring_me_.Erase(position_);
     }
+    sheet_.RemoveRangeDependencies(*this);
 }
 
 void Cell::AddDependencies() {
     for (Position position :cells_referring_by_me_) {
-        Cell* cell = static_cast<Cell*>(sheet_.GetCell(position));
-        if (cell != nullptr) cell->cells_referring_me_.insert(position_);
+        Cell* cell = sheet_.FindCell(position);
+        if (cell != nullptr) cell->cells_referring_me_.Insert(position_);
     }
+    sheet_.AddRangeDependencies(*this);
 }
 
-bool Cell::HasCircularDependencies(const PositionsSet& dependents) const {
-    PositionsSet visited;
-    return HasCircularDependencies(position_, visited, dependents);
-}
-
-bool Cell::HasCircularDependencies(Position start_position, PositionsSet& visited, const PositionsSet& dependents) const {
+bool Cell::HasCircularDependencies(const PositionsSet& dependents, ShiftedSpan<Range> ranges) const {
+    // Цикл появляется, только если новая связь нарушает топологический порядок
+    // и при этом из ячейки уже есть путь к той, на которую она ссылается.
+    // Несуществующие ячейки будут созданы в начале порядка и циклов не дают,
+    // поэтому в диапазонах проверяются только существующие ячейки.
     for (Position pos : dependents) {
-        if (visited.count(pos) > 0) continue;
-        visited.insert(pos);
-
-        Cell* cell = static_cast<Cell*>(sheet_.GetCell(pos));
-
-        if (pos == start_position) return true;
-        if (cell == nullptr) continue;
-
-        if (HasCircularDependencies(
-                start_position,
-                visited,
-                cell->cells_referring_by_me_)) {
-            return true;
-        }
+        if (pos == position_) return true;
+        const Cell* cell = sheet_.FindCell(pos);
+        if (cell != nullptr && !sheet_.KeepOrdered(*cell, *this)) return true;
+    }
+    for (const Range& range : ranges) {
+        if (range.Contains(position_)) return true;
+        bool ordered = true;
+        sheet_.ForEachCellInRange(range, [this, &ordered](const Cell& cell) {
+            if (ordered) ordered = sheet_.KeepOrdered(cell, *this);
+        });
+        if (!ordered) return true;
     }
     return false;
 }
 
 void Cell::InvalidateCache() {
-    impl_->InvalidateCache();
-    for (Position position : cells_referring_me_) {
-        Cell* cell = static_cast<Cell*>(sheet_.GetCell(position));
-        if (cell != nullptr && cell->impl_->HasCache()) {
-            cell->InvalidateCache();
-        };
+    // Обход зависимых ячеек с явным стеком: длинные цепочки формул
+    // не упираются в глубину стека вызовов. Ячейка без кэша не может
+    // иметь зависимых с кэшем, поэтому дальше неё обход не идёт.
+    std::vector<Cell*> stack{this};
+    while (!stack.empty()) {
+        Cell* cell = stack.back();
+        stack.pop_back();
+        if (cell != this && !cell->impl_->HasCache()) continue;
+
+        cell->impl_->InvalidateCache();
+        if (cell != this) sheet_.MarkDirty(*cell);
+        sheet_.ForEachDependent(*cell, [&stack](Cell& dependent) {
+            if (dependent.impl_->HasCache()) {
+                stack.push_back(&dependent);
+            }
+        });
     }
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    const ShiftedSpan<Position> cells = impl_->GetReferencedCells();
+    return {cells.begin(), cells.end()};
+}
+
+Position Cell::GetPosition() const {
+    return position_;
+}
+
+const Cell::PositionsSet& Cell::GetPrecedents() const {
+    return cells_referring_by_me_;
+}
+
+ShiftedSpan<Range> Cell::GetPrecedentRanges() const {
+    return impl_->GetReferencedRanges();
+}
+
+bool Cell::IsStale() const {
+    return impl_->IsStale();
+}
+
+void Cell::Evaluate() const {
+    impl_->GetValueView(sheet_);
 }
 
 // CellImpl definitions
 
+CellImpl::Value CellImpl::GetValue(const SheetInterface& sheet) const {
+    return std::visit([](auto value) -> Value {
+        if constexpr (std::is_same_v<decltype(value), std::string_view>) {
+            return std::string(value);
+        } else {
+            return value;
+        }
+    }, GetValueView(sheet));
+}
+
+bool CellImpl::HasText(std::string_view text) const {
+    return GetText() == text;
+}
+
+std::optional<double> CellImpl::GetTextNumber() const { return std::nullopt; }
 bool CellImpl::HasCache() const { return false; }
+bool CellImpl::IsStale() const { return false; }
 void CellImpl::InvalidateCache() {}
-std::vector<Position> CellImpl::GetReferencedCells() const { return {}; }
+void CellImpl::SetCache(FormulaInterface::Value) const {}
+ShiftedSpan<Position> CellImpl::GetReferencedCells() const { return {}; }
+ShiftedSpan<Range> CellImpl::GetReferencedRanges() const { return {}; }
+const FormulaInterface* CellImpl::GetFormula() const { return nullptr; }
 
 TextImpl::TextImpl(std::string expression)
-: value_(std::move(expression)) {}
+: value_(std::move(expression))
+, number_(TextAsNumber(UnescapedText(value_)).value_or(std::numeric_limits<double>::quiet_NaN())) {}
 
-std::string TextImpl::GetText() const { return value_; }
+std::string_view TextImpl::GetText() const { return value_; }
 
-CellImpl::Value TextImpl::GetValue(const SheetInterface&) const {
-    if (value_.front() == ESCAPE_SIGN) {
-        return value_.substr(1);
-    } else {
-        return value_;
-    }
+CellImpl::ValueView TextImpl::GetValueView(const SheetInterface&) const {
+    return UnescapedText(value_);
+}
+
+std::optional<double> TextImpl::GetTextNumber() const {
+    if (std::isnan(number_)) return std::nullopt;
+    return number_;
 }
 
-FormulaImpl::FormulaImpl(const std::string& expression)
-: formula_(ParseFormula(expression)) {}
+FormulaImpl::FormulaImpl(const std::string& expression, Position anchor)
+: formula_(ParseFormula(expression, anchor)) {}
 
-std::string FormulaImpl::GetText() const {
-    std::string result = "="s;
-    result.append(formula_->GetExpression());
-    return result;
+FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, std::optional<FormulaInterface::Value> cache)
+: formula_(std::move(formula)), cache_(std::move(cache)) {}
+
+FormulaImpl::~FormulaImpl() {
+    delete text_.load(std::memory_order_acquire);
+}
+
+std::string_view FormulaImpl::GetText() const {
+    const std::string* text = text_.load(std::memory_order_acquire);
+    if (text == nullptr) {
+        auto printed = std::make_unique<const std::string>(FORMULA_SIGN + formula_->GetExpression());
+        if (text_.compare_exchange_strong(text, printed.get(), std::memory_order_acq_rel)) {
+            text = printed.release();
+        }
+    }
+    return *text;
+}
+
+bool FormulaImpl::HasText(std::string_view text) const {
+    return text.size() > 1 && text.front() == FORMULA_SIGN && formula_->IsParsedFrom(text.substr(1));
 }
 
-CellImpl::Value FormulaImpl::GetValue(const SheetInterface& sheet) const {
-    if (HasCache()) return cache_.value();
-    std::variant<double, FormulaError> res = formula_->Evaluate(sheet);
-    std::visit([&](const auto& val){
-        cache_ = val;
-    }, res);
-    return cache_.value();
+CellImpl::ValueView FormulaImpl::GetValueView(const SheetInterface& sheet) const {
+    if (!HasCache()) cache_ = formula_->Evaluate(sheet);
+    return std::visit([](auto value) -> ValueView {
+        return value;
+    }, *cache_);
 }
 
 bool FormulaImpl::HasCache() const {
     return cache_.has_value();
 }
 
+bool FormulaImpl::IsStale() const {
+    return !cache_.has_value();
+}
+
 void FormulaImpl::InvalidateCache() {
     cache_.reset();
 }
 
-std::vector<Position> FormulaImpl::GetReferencedCells() const {
+void FormulaImpl::SetCache(FormulaInterface::Value value) const {
+    cache_ = std::move(value);
+}
+
+ShiftedSpan<Position> FormulaImpl::GetReferencedCells() const {
     return formula_->GetReferencedCells();
 }
+
+ShiftedSpan<Range> FormulaImpl::GetReferencedRanges() const {
+    return formula_->GetReferencedRanges();
+}
+
+const FormulaInterface* FormulaImpl::GetFormula() const {
+    return formula_.get();
+}
@@ -2,76 +2,149 @@
 
 #include "common.h"
 #include "formula.h"
+#include "position_set.h"
+#include "slab_pool.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <optional>
 #include <functional>
-#include <unordered_set>
 
 class CellImpl;
+class Sheet;
 
-class Cell : public CellInterface {
+// Ячейки и их содержимое создаются в пулах листа (Sheet::NewCell, Sheet::ImplPool).
+class Cell : public CellInterface, public SlabAllocated {
 public:
-    explicit Cell(SheetInterface& sheet, Position position);
+    using PositionsSet = PositionSet;
+
+    explicit Cell(Sheet& sheet, Position position);
     ~Cell();
 
+    // Содержимое ячейки position для текста так, как его задаёт Set.
+    static std::unique_ptr<CellImpl> MakeImpl(SlabPool& pool, const std::string& text, Position position);
+
     void Set(const std::string& text);
     void Clear();
     Value GetValue() const override;
-    std::string GetText() const override;
+    ValueView GetValueView() const override;
+    std::optional<double> GetTextNumber() const override;
+    std::string_view GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    // Ничего ли не изменит запись text в ячейку: текст тот же, а у формулы -
+    // тот же текст со ссылками относительно ячейки (FormulaInterface::IsParsedFrom).
+    bool HasText(std::string_view text) const;
+
+    Position GetPosition() const;
+    // Ячейки, на которые формула ссылается по отдельности.
+    const PositionsSet& GetPrecedents() const;
+    // Диапазоны, от всех ячеек которых зависит формула.
+    ShiftedSpan<Range> GetPrecedentRanges() const;
+    // Формула, значение которой ещё не вычислено после изменений.
+    bool IsStale() const;
+    // Вычисляет значение формулы. Ячейки, на которые она ссылается,
+    // к этому моменту должны быть вычислены, иначе вычисление уйдёт в рекурсию.
+    void Evaluate() const;
 
 private:
-    using PositionsSet = std::unordered_set<Position, std::hash<Position>>;
+    friend class Sheet;
 
-    SheetInterface& sheet_;
+    Sheet& sheet_;
     std::unique_ptr<CellImpl> impl_;
     Position position_;
     PositionsSet cells_referring_me_;
     PositionsSet cells_referring_by_me_;
+    // Позиция ячейки уже стоит в очереди устаревших ячеек листа.
+    bool queued_ = false;
+    // Номер последнего обхода графа зависимостей, посетившего ячейку.
+    mutable std::uint32_t visit_mark_ = 0;
+    // Место ячейки в топологическом порядке, который поддерживает лист.
+    mutable std::int64_t order_ = 0;
+    // Рабочий счётчик проходов листа по графу: уровень ячейки при параллельном
+    // пересчёте, число необработанных предшественников при применении пакета.
+    mutable std::uint32_t scratch_ = 0;
 
     void RemoveDependencies();
     void AddDependencies();
-    void UpdateDependencies(PositionsSet&& cells_included_by_me_tmp);
-    bool HasCircularDependencies(Position start_position, PositionsSet& visited, const PositionsSet& new_dependents) const;
-    bool HasCircularDependencies(const PositionsSet& new_dependents) const;
+    // Заменяет содержимое ячейки и её связи.
+    void UpdateDependencies(std::unique_ptr<CellImpl> impl, PositionsSet&& cells_included_by_me_tmp);
+    bool HasCircularDependencies(const PositionsSet& new_dependents, ShiftedSpan<Range> new_ranges) const;
     void InvalidateCache();
 };
 
-class CellImpl {
+class CellImpl : public SlabAllocated {
 public:
-    using Value = std::variant<std::string, double, FormulaError>;
-    virtual std::string GetText() const = 0;
-    virtual Value GetValue(const SheetInterface& sheet) const = 0;
+    using Value = CellInterface::Value;
+    using ValueView = CellInterface::ValueView;
+    virtual std::string_view GetText() const = 0;
+    // Ничего ли не изменит запись text в ячейку (см. Cell::HasText).
+    virtual bool HasText(std::string_view text) const;
+    // Копия значения из GetValueView.
+    Value GetValue(const SheetInterface& sheet) const;
+    virtual ValueView GetValueView(const SheetInterface& sheet) const = 0;
+    virtual std::optional<double> GetTextNumber() const;
     virtual bool HasCache() const;
+    virtual bool IsStale() const;
     virtual void InvalidateCache();
-    virtual std::vector<Position> GetReferencedCells() const;
+    // Запоминает значение формулы, вычисленное вместе с соседними (Sheet::EvaluateCells).
+    virtual void SetCache(FormulaInterface::Value value) const;
+    virtual ShiftedSpan<Position> GetReferencedCells() const;
+    virtual ShiftedSpan<Range> GetReferencedRanges() const;
+    // Формула ячейки, nullptr для пустых и текстовых ячеек.
+    virtual const FormulaInterface* GetFormula() const;
     virtual ~CellImpl() = default;
 };
 
 class EmptyImpl : public CellImpl {
 public:
-    std::string GetText() const override { return ""s; }
-    Value GetValue(const SheetInterface&) const override { return ""s; }
+    std::string_view GetText() const override { return {}; }
+    ValueView GetValueView(const SheetInterface&) const override { return ""sv; }
 };
 
 class TextImpl : public CellImpl {
 public:
     explicit TextImpl(std::string expression);
-    std::string GetText() const override;
-    Value GetValue(const SheetInterface&) const override;
+    std::string_view GetText() const override;
+    ValueView GetValueView(const SheetInterface&) const override;
+    std::optional<double> GetTextNumber() const override;
 private:
     std::string value_;
+    // Числовое прочтение значения, вычисленное в конструкторе, или NaN,
+    // если текст не число (NaN записью числа не получить).
+    double number_;
 };
 
 class FormulaImpl : public CellImpl {
 public:
-    explicit FormulaImpl(const std::string& expression);
-    std::string GetText() const override;
-    Value GetValue(const SheetInterface& sheet) const override;
+    // Формула ячейки anchor, см. ParseFormula.
+    FormulaImpl(const std::string& expression, Position anchor);
+    // Готовая формула, например из снимка листа, с уже вычисленным значением, если оно есть.
+    FormulaImpl(std::unique_ptr<FormulaInterface> formula, std::optional<FormulaInterface::Value> cache);
+    ~FormulaImpl();
+    std::string_view GetText() const override;
+    // Формулу не меняет текст, разбираемый в тот же шаблон у той же ячейки
+    // (FormulaInterface::IsParsedFrom): каноническую запись для этого не печатают.
+    bool HasText(std::string_view text) const override;
+    ValueView GetValueView(const SheetInterface& sheet) const override;
     virtual bool HasCache() const override;
+    bool IsStale() const override;
     void InvalidateCache() override;
-    std::vector<Position> GetReferencedCells() const override;
+    void SetCache(FormulaInterface::Value value) const override;
+    ShiftedSpan<Position> GetReferencedCells() const override;
+    ShiftedSpan<Range> GetReferencedRanges() const override;
+    const FormulaInterface* GetFormula() const override;
 private:
     std::unique_ptr<FormulaInterface> formula_;
-    mutable std::optional<Value> cache_;
+    mutable std::optional<FormulaInterface::Value> cache_;
+    // "=" и каноническая запись формулы. Печатается при первом обращении:
+    // протянутым формулам, текст которых не читают, она не нужна. Читатели
+    // из разных потоков договариваются через compare_exchange, лишняя копия
+    // удаляется. В ячейке от текста остаётся один указатель: содержимое
+    // ячеек всех видов занимает в пуле блоки одного размера.
+    mutable std::atomic<const std::string*> text_{nullptr};
 };
+
+// Блок пула, в котором помещается содержимое ячейки любого вида.
+inline constexpr std::size_t CELL_IMPL_SIZE = std::max({sizeof(EmptyImpl), sizeof(TextImpl), sizeof(FormulaImpl)});
+inline constexpr std::size_t CELL_IMPL_ALIGN = std::max({alignof(EmptyImpl), alignof(TextImpl), alignof(FormulaImpl)});
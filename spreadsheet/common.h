@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
+#include <iterator>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -19,13 +22,15 @@ struct Position {
     bool operator<(Position rhs) const;
 
     bool IsValid() const;
+    // Позиция, сдвинутая на offset.row строк и offset.col столбцов.
+    Position Shifted(Position offset) const;
     std::string ConvertColToString(int val) const;
     std::string ToString() const;
 
     static Position FromString(std::string_view str);
 
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
+    static constexpr int MAX_ROWS = 16384;
+    static constexpr int MAX_COLS = 16384;
     static const Position NONE;
 };
 
@@ -45,6 +50,145 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольный диапазон ячеек: first - левый верхний угол, last - правый нижний.
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+    bool Contains(Position pos) const;
+    Range Shifted(Position offset) const;
+    std::string ToString() const;
+
+    // Диапазон по двум любым противоположным углам.
+    static Range FromCorners(Position lhs, Position rhs);
+};
+
+// Непрерывный массив, которым владеет другой объект: указатель и длина,
+// без копирования элементов. Действителен, пока жив владелец.
+template <typename T>
+class Span {
+public:
+    Span() = default;
+
+    Span(const T* data, std::size_t size)
+        : data_(data)
+        , size_(size) {
+    }
+
+    Span(const std::vector<T>& values)
+        : data_(values.data())
+        , size_(values.size()) {
+    }
+
+    const T* begin() const {
+        return data_;
+    }
+
+    const T* end() const {
+        return data_ + size_;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    const T& operator[](std::size_t index) const {
+        return data_[index];
+    }
+
+private:
+    const T* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+// Span позиций или диапазонов, элементы которого при чтении сдвигаются
+// на offset: так общий для многих формул массив ссылок, записанных
+// относительно ячейки формулы, читается как ссылки конкретной ячейки.
+template <typename T>
+class ShiftedSpan {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = T;
+
+        Iterator(const T* item, Position offset)
+            : item_(item)
+            , offset_(offset) {
+        }
+
+        T operator*() const {
+            return item_->Shifted(offset_);
+        }
+
+        Iterator& operator++() {
+            ++item_;
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator result = *this;
+            ++item_;
+            return result;
+        }
+
+        bool operator==(const Iterator& rhs) const {
+            return item_ == rhs.item_;
+        }
+
+        bool operator!=(const Iterator& rhs) const {
+            return item_ != rhs.item_;
+        }
+
+    private:
+        const T* item_;
+        Position offset_;
+    };
+
+    ShiftedSpan() = default;
+
+    ShiftedSpan(Span<T> items, Position offset = {})
+        : items_(items)
+        , offset_(offset) {
+    }
+
+    ShiftedSpan(const std::vector<T>& items)
+        : items_(items) {
+    }
+
+    Iterator begin() const {
+        return {items_.begin(), offset_};
+    }
+
+    Iterator end() const {
+        return {items_.end(), offset_};
+    }
+
+    std::size_t size() const {
+        return items_.size();
+    }
+
+    bool empty() const {
+        return items_.empty();
+    }
+
+    T operator[](std::size_t index) const {
+        return items_[index].Shifted(offset_);
+    }
+
+private:
+    Span<T> items_;
+    Position offset_;
+};
+
 class FormulaError {
 public:
     enum class Category {
@@ -83,10 +227,20 @@ public:
 class CellInterface {
 public:
     using Value = std::variant<std::string, double, FormulaError>;
+    // Значение без копирования строки: string_view указывает в текст ячейки
+    // и действителен, пока ячейка не изменена.
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
     virtual ~CellInterface() = default;
 
     virtual Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
+    // То же значение, что GetValue, но без выделения памяти.
+    virtual ValueView GetValueView() const = 0;
+    // Число, которым формулы читают текст ячейки, или nullopt, если текст
+    // не число или в ячейке формула. Текст разбирается один раз при записи.
+    virtual std::optional<double> GetTextNumber() const = 0;
+    // Текст ячейки, для формулы - в каноническом виде. Хранится в ячейке,
+    // view действителен, пока ячейка не изменена.
+    virtual std::string_view GetText() const = 0;
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
@@ -104,6 +258,30 @@ public:
     virtual Size GetPrintableSize() const = 0;
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Пакетное изменение: SetCell и ClearCell между BeginBatch и CommitBatch
+    // только запоминают правки, а CommitBatch применяет их все разом, один раз
+    // перестраивая связи и проверяя циклы. До CommitBatch лист показывает прежнее
+    // содержимое. Если правки замыкают цикл, CommitBatch отменяет весь пакет и
+    // бросает CircularDependencyException. Пакеты могут быть вложенными, правки
+    // применяет внешний CommitBatch.
+    virtual void BeginBatch() = 0;
+    virtual void CommitBatch() = 0;
+
+    // Чтение значений для формул. Лист может хранить числовые константы
+    // отдельно, без объектов ячеек, поэтому формулы читают ячейки через эти
+    // методы, а не через GetCell, которому для такой позиции нужен объект.
+    // Число-константа в позиции pos, если лист хранит его отдельно.
+    virtual std::optional<double> GetStoredNumber(Position pos) const;
+    // Дописывает в numbers отдельно хранящиеся числа из range, а в cells -
+    // остальные непустые ячейки диапазона. Порядок не определён.
+    virtual void GetRangeCells(Range range, std::vector<double>& numbers,
+                               std::vector<const CellInterface*>& cells) const;
+    // Ячейки столбца от top вниз, count строк: в numbers[k] - отдельно
+    // хранящееся число строки top.row + k или 0, в cells[k] - остальная
+    // непустая ячейка этой строки или nullptr.
+    virtual void GetColumnCells(Position top, std::size_t count, double* numbers,
+                                const CellInterface** cells) const;
 };
 
 std::unique_ptr<SheetInterface> CreateSheet();
@@ -4,7 +4,10 @@
 
 #include <algorithm>
 #include <sstream>
-#include <charconv>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
 
 using namespace std::literals;
 
@@ -12,27 +15,212 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     return output << fe.ToString();
 }
 
+std::optional<double> TextAsNumber(std::string_view text) {
+    if (text.empty() || ASTImpl::MatchNumberLiteral(text) != text.size()) {
+        return std::nullopt;
+    }
+    return ASTImpl::ParseNumberLiteral(text);
+}
+
+const FormulaAST* FormulaInterface::GetTemplate() const {
+    return nullptr;
+}
+
+bool FormulaInterface::IsParsedFrom(std::string_view) const {
+    return false;
+}
+
+bool FormulaInterface::EvaluateRun(const SheetInterface&, std::size_t, std::vector<Value>&) const {
+    return false;
+}
+
 namespace {
 
+    // Значение непустой ячейки-объекта для формулы (см. GetCellValueAsDouble).
+    double CellValueAsDouble(const CellInterface* cell) {
+        CellInterface::ValueView value = cell->GetValueView();
+        if (std::holds_alternative<double>(value)) {
+            return std::get<double>(value);
+        }
+
+        if (std::holds_alternative<std::string_view>(value)) {
+            std::string_view string_value = std::get<std::string_view>(value);
+            if (string_value.empty()) return 0.0;
+
+            if (auto number = cell->GetTextNumber()) {
+                return *number;
+            }
+            throw FormulaError(FormulaError::Category::Value);
+        }
+
+        throw FormulaError(std::get<FormulaError>(value));
+    }
+
+}  // namespace
+
+double GetCellValueAsDouble(const SheetInterface& sheet, Position pos) {
+    if (std::optional<double> number = sheet.GetStoredNumber(pos)) return *number;
+    const CellInterface* cell = sheet.GetCell(pos);
+    if (cell == nullptr) return 0.0;
+    return CellValueAsDouble(cell);
+}
+
+void GetRangeValues(const SheetInterface& sheet, Range range, std::vector<double>& values) {
+    std::vector<const CellInterface*> cells;
+    sheet.GetRangeCells(range, values, cells);
+    for (const CellInterface* cell : cells) {
+        CellInterface::ValueView value = cell->GetValueView();
+        if (std::holds_alternative<double>(value)) {
+            values.push_back(std::get<double>(value));
+        } else if (std::holds_alternative<std::string_view>(value)) {
+            std::string_view string_value = std::get<std::string_view>(value);
+            if (string_value.empty()) continue;
+            if (auto number = cell->GetTextNumber()) {
+                values.push_back(*number);
+            }
+        } else {
+            throw FormulaError(std::get<FormulaError>(value));
+        }
+    }
+}
+
+namespace {
+
+    // Шаблон формулы и его текст со ссылками относительно ячейки формулы
+    // (ASTImpl::RelativeText). Текст пуст, если его построить не удалось.
+    struct CompiledFormula {
+        FormulaAST ast;
+        std::string relative_text;
+    };
+
+    class FormulaCache {
+    public:
+        static constexpr std::size_t DEFAULT_CAPACITY = 1 << 14;
+
+        static FormulaCache& Instance() {
+            static FormulaCache cache;
+            return cache;
+        }
+
+        // Шаблон формулы ячейки anchor: ссылки в нём записаны относительно anchor.
+        std::shared_ptr<const CompiledFormula> Get(std::string_view expression, Position anchor);
+        FormulaCacheStats GetStats() const;
+        void SetCapacity(std::size_t capacity);
+        void Clear();
+
+    private:
+        // Разобранная формула не изменяется после создания, поэтому один
+        // экземпляр разделяют все формулы с тем же относительным текстом.
+        using Entry = std::shared_ptr<const CompiledFormula>;
+
+        void Shrink();
+
+        mutable std::mutex mutex_;
+        std::size_t capacity_ = DEFAULT_CAPACITY;
+        std::size_t hits_ = 0;
+        std::size_t misses_ = 0;
+        // В начале списка - последние использованные записи, ключи индекса
+        // ссылаются на относительные тексты шаблонов списка.
+        std::list<Entry> entries_;
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    };
+
+    std::string_view NormalizeExpression(std::string_view expression) {
+        constexpr auto WHITESPACE = " \t\n\r"sv;
+        std::size_t begin = expression.find_first_not_of(WHITESPACE);
+        if (begin == std::string_view::npos) {
+            return {};
+        }
+        std::size_t end = expression.find_last_not_of(WHITESPACE);
+        return expression.substr(begin, end - begin + 1);
+    }
+
+    std::shared_ptr<const CompiledFormula> Compile(std::string_view expression, Position anchor,
+                                                   std::string relative_text) {
+        FormulaAST ast = ParseFormulaAST(expression);
+        ast.Shift({-anchor.row, -anchor.col});
+        return std::make_shared<const CompiledFormula>(CompiledFormula{std::move(ast), std::move(relative_text)});
+    }
+
+    std::shared_ptr<const CompiledFormula> FormulaCache::Get(std::string_view expression, Position anchor) {
+        expression = NormalizeExpression(expression);
+        std::optional<std::string> key = ASTImpl::RelativeText(expression, anchor);
+        if (!key) {
+            // Некорректная ссылка: разбор сообщит об ошибке.
+            return Compile(expression, anchor, {});
+        }
+        {
+            std::lock_guard guard(mutex_);
+            if (auto it = index_.find(*key); it != index_.end()) {
+                ++hits_;
+                entries_.splice(entries_.begin(), entries_, it->second);
+                return *it->second;
+            }
+            ++misses_;
+        }
+        // Разбор идёт без блокировки, чтобы потоки не ждали друг друга.
+        auto compiled = Compile(expression, anchor, std::move(*key));
+
+        std::lock_guard guard(mutex_);
+        if (capacity_ == 0) {
+            return compiled;
+        }
+        if (auto it = index_.find(compiled->relative_text); it != index_.end()) {
+            return *it->second;
+        }
+        entries_.push_front(compiled);
+        index_.emplace(compiled->relative_text, entries_.begin());
+        Shrink();
+        return compiled;
+    }
+
+    FormulaCacheStats FormulaCache::GetStats() const {
+        std::lock_guard guard(mutex_);
+        return {hits_, misses_, entries_.size(), capacity_};
+    }
+
+    void FormulaCache::SetCapacity(std::size_t capacity) {
+        std::lock_guard guard(mutex_);
+        capacity_ = capacity;
+        Shrink();
+    }
+
+    void FormulaCache::Clear() {
+        std::lock_guard guard(mutex_);
+        index_.clear();
+        entries_.clear();
+        hits_ = 0;
+        misses_ = 0;
+    }
+
+    void FormulaCache::Shrink() {
+        while (entries_.size() > capacity_) {
+            index_.erase(entries_.back()->relative_text);
+            entries_.pop_back();
+        }
+    }
+
+    // Формула - шаблон со ссылками относительно ячейки anchor_ и сама эта ячейка.
     class Formula : public FormulaInterface {
     public:
-        explicit Formula(std::string expression);
+        Formula(std::string expression, Position anchor);
         Value Evaluate(const SheetInterface &sheet) const override;
         std::string GetExpression() const override;
-        std::vector<Position> GetReferencedCells() const override;
+        ShiftedSpan<Position> GetReferencedCells() const override;
+        ShiftedSpan<Range> GetReferencedRanges() const override;
+        void SerializeProgram(std::string& out) const override;
+        const FormulaAST* GetTemplate() const override;
+        bool IsParsedFrom(std::string_view expression) const override;
+        bool EvaluateRun(const SheetInterface& sheet, std::size_t count, std::vector<Value>& values) const override;
 
     private:
-        FormulaAST ast_;
-        std::vector<Position> referenced_cells_;
-        double GetCellValueAsDouble(const SheetInterface& sheet, Position pos) const;
+        std::shared_ptr<const CompiledFormula> compiled_;
+        Position anchor_;
     };
 
-    Formula::Formula(std::string expression)
-    try : ast_(ParseFormulaAST(expression)),
-          referenced_cells_(ast_.GetCells().begin(), ast_.GetCells().end())
+    Formula::Formula(std::string expression, Position anchor)
+    try : compiled_(FormulaCache::Instance().Get(expression, anchor)), anchor_(anchor)
     {
-        auto end_iterator = std::unique(referenced_cells_.begin(), referenced_cells_.end());
-        referenced_cells_.resize(end_iterator - referenced_cells_.begin());
     } catch (std::exception& error) {
         throw FormulaException("Некорректная формула: "s.append(error.what()));
     }
@@ -41,8 +229,10 @@ namespace {
 
         double result;
         try {
-            result = ast_.Execute([this, &sheet](Position pos) -> double {
-                return GetCellValueAsDouble(sheet, pos);
+            result = compiled_->ast.Execute([this, &sheet](Position pos) -> double {
+                return GetCellValueAsDouble(sheet, pos.Shifted(anchor_));
+            }, [this, &sheet](Range range, std::vector<double>& values) {
+                GetRangeValues(sheet, range.Shifted(anchor_), values);
             });
         } catch (FormulaError &err) {
             return err;
@@ -50,52 +240,178 @@ namespace {
         return result;
     }
 
-    double Formula::GetCellValueAsDouble(const SheetInterface& sheet, Position pos) const {
-        const CellInterface* cell = sheet.GetCell(pos);
-        if (cell == nullptr) return 0.0;
+    std::string Formula::GetExpression() const {
+        // Поток создаётся один раз на поток: его конструктор дороже самой печати.
+        thread_local std::ostringstream out;
+        out.str({});
+        compiled_->ast.PrintFormula(out, anchor_);
+        return out.str();
+    }
 
-        CellInterface::Value value = cell->GetValue();
-        if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
-        }
+    ShiftedSpan<Position> Formula::GetReferencedCells() const {
+        return {compiled_->ast.GetCells(), anchor_};
+    }
 
-        if (std::holds_alternative<std::string>(value)) {
-            std::string string_value = std::get<std::string>(value);
-            if (string_value.empty()) return 0.0;
+    ShiftedSpan<Range> Formula::GetReferencedRanges() const {
+        return {compiled_->ast.GetRanges(), anchor_};
+    }
+
+    void Formula::SerializeProgram(std::string& out) const {
+        compiled_->ast.GetProgram().Serialize(out, anchor_);
+    }
+
+    const FormulaAST* Formula::GetTemplate() const {
+        return &compiled_->ast;
+    }
+
+    bool Formula::IsParsedFrom(std::string_view expression) const {
+        // Одинаковый относительный текст в одной ячейке даёт тот же шаблон.
+        if (compiled_->relative_text.empty()) return false;
+        thread_local std::string text;
+        return ASTImpl::RelativeText(NormalizeExpression(expression), anchor_, text)
+            && text == compiled_->relative_text;
+    }
 
-            for (char ch : string_value){ // Строка должна состоять только из чисел, почему-то from_chars преобразует строку 3C в 3
-                if (!std::isdigit(static_cast<unsigned char>(ch))){
-                    throw FormulaError(FormulaError::Category::Value);
+    bool Formula::EvaluateRun(const SheetInterface& sheet, std::size_t count, std::vector<Value>& values) const {
+        for (Position cell : compiled_->ast.GetCells()) {
+            if (cell.col == 0) return false;
+        }
+        std::vector<double> results(count);
+        std::vector<std::optional<FormulaError>> errors(count);
+        // Столбец ссылки читается у листа целиком; по одной разбираются
+        // только ячейки-объекты, а числа и пустые ячейки уже лежат в values.
+        std::vector<const CellInterface*> cells(count);
+        const bool done = compiled_->ast.GetProgram().ExecuteRun(count, [this, &sheet, &cells](
+                Position first, std::size_t count, double* values, std::optional<FormulaError>* errors) {
+            sheet.GetColumnCells(first.Shifted(anchor_), count, values, cells.data());
+            for (std::size_t k = 0; k < count; ++k) {
+                if (cells[k] == nullptr) continue;
+                try {
+                    values[k] = CellValueAsDouble(cells[k]);
+                } catch (const FormulaError& error) {
+                    errors[k] = error;
                 }
             }
-            int res_num;
-            auto result = std::from_chars(string_value.data(),
-                                          string_value.data() + string_value.size(),
-                                          res_num);
-
-            if (result.ec == std::errc::invalid_argument ||
-                    result.ec == std::errc::result_out_of_range)
-                {
-                throw FormulaError(FormulaError::Category::Value);
-                }
+        }, results.data(), errors.data());
+        if (!done) return false;
 
-            return res_num;
+        values.clear();
+        values.reserve(count);
+        for (std::size_t k = 0; k < count; ++k) {
+            if (errors[k]) {
+                values.emplace_back(*errors[k]);
+            } else {
+                values.emplace_back(results[k]);
+            }
         }
+        return true;
+    }
 
-        throw FormulaError(std::get<FormulaError>(value));
+    class SnapshotFormula : public FormulaInterface {
+    public:
+        SnapshotFormula(std::shared_ptr<const void> storage, std::string_view expression,
+                        std::string_view program, std::vector<Position> referenced_cells,
+                        std::vector<Range> referenced_ranges);
+        Value Evaluate(const SheetInterface& sheet) const override;
+        std::string GetExpression() const override;
+        ShiftedSpan<Position> GetReferencedCells() const override;
+        ShiftedSpan<Range> GetReferencedRanges() const override;
+        void SerializeProgram(std::string& out) const override;
+
+    private:
+        std::shared_ptr<const void> storage_;
+        std::string_view expression_;
+        std::string_view program_bytes_;
+        std::vector<Position> referenced_cells_;
+        std::vector<Range> referenced_ranges_;
+        mutable std::once_flag decoded_;
+        mutable ASTImpl::Program program_;
+    };
+
+    SnapshotFormula::SnapshotFormula(std::shared_ptr<const void> storage, std::string_view expression,
+                                     std::string_view program, std::vector<Position> referenced_cells,
+                                     std::vector<Range> referenced_ranges)
+    : storage_(std::move(storage)),
+      expression_(expression),
+      program_bytes_(program),
+      referenced_cells_(std::move(referenced_cells)),
+      referenced_ranges_(std::move(referenced_ranges)) {}
+
+    FormulaInterface::Value SnapshotFormula::Evaluate(const SheetInterface& sheet) const {
+        std::call_once(decoded_, [this] {
+            try {
+                program_ = ASTImpl::Program::Deserialize(program_bytes_);
+            } catch (const ParsingError& error) {
+                throw FormulaException("Повреждённая формула в снимке: "s.append(error.what()));
+            }
+        });
+        try {
+            return program_.Execute([&sheet](Position pos) -> double {
+                return GetCellValueAsDouble(sheet, pos);
+            }, [&sheet](Range range, std::vector<double>& values) {
+                GetRangeValues(sheet, range, values);
+            });
+        } catch (FormulaError& err) {
+            return err;
+        }
     }
 
-    std::string Formula::GetExpression() const {
-        std::stringstream out;
-        ast_.PrintFormula(out);
-        return out.str();
+    std::string SnapshotFormula::GetExpression() const {
+        return std::string(expression_);
     }
 
-    std::vector<Position> Formula::GetReferencedCells() const {
+    ShiftedSpan<Position> SnapshotFormula::GetReferencedCells() const {
         return referenced_cells_;
     }
+
+    ShiftedSpan<Range> SnapshotFormula::GetReferencedRanges() const {
+        return referenced_ranges_;
+    }
+
+    void SnapshotFormula::SerializeProgram(std::string& out) const {
+        out.append(program_bytes_);
+    }
 }
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-        return std::make_unique<Formula>(std::move(expression));
+        return ParseFormula(std::move(expression), Position{0, 0});
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor) {
+        return std::make_unique<Formula>(std::move(expression), anchor);
+}
+
+std::unique_ptr<FormulaInterface> RestoreFormula(std::shared_ptr<const void> storage,
+                                                 std::string_view expression, std::string_view program,
+                                                 std::vector<Position> referenced_cells,
+                                                 std::vector<Range> referenced_ranges) {
+    // Граф зависимостей листа строится по спискам ссылок, поэтому программа
+    // не должна читать ничего сверх них.
+    try {
+        ASTImpl::Program::ForEachSerializedReference(program, [&referenced_cells](Position cell) {
+            if (!std::binary_search(referenced_cells.begin(), referenced_cells.end(), cell)) {
+                throw ParsingError("Program refers to a cell outside its references");
+            }
+        }, [&referenced_ranges](Range range) {
+            if (std::find(referenced_ranges.begin(), referenced_ranges.end(), range) == referenced_ranges.end()) {
+                throw ParsingError("Program refers to a range outside its references");
+            }
+        });
+    } catch (const ParsingError& error) {
+        throw FormulaException("Повреждённая формула в снимке: "s.append(error.what()));
+    }
+    return std::make_unique<SnapshotFormula>(std::move(storage), expression, program, std::move(referenced_cells),
+                                             std::move(referenced_ranges));
+}
+
+FormulaCacheStats GetFormulaCacheStats() {
+    return FormulaCache::Instance().GetStats();
+}
+
+void SetFormulaCacheCapacity(std::size_t capacity) {
+    FormulaCache::Instance().SetCapacity(capacity);
+}
+
+void ClearFormulaCache() {
+    FormulaCache::Instance().Clear();
 }
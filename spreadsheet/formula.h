@@ -2,9 +2,12 @@
 
 #include "common.h"
 
+#include <cstddef>
 #include <memory>
 #include <vector>
 
+class FormulaAST;
+
 class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
@@ -12,7 +15,72 @@ public:
 
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
     virtual std::string GetExpression() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Ячейки, на которые формула ссылается по отдельности, по возрастанию
+    // без повторов. Ячейки диапазонов сюда не входят, сами диапазоны
+    // возвращает GetReferencedRanges. Списки принадлежат формуле или её
+    // шаблону и сдвигаются к ячейке формулы при чтении.
+    virtual ShiftedSpan<Position> GetReferencedCells() const = 0;
+    // Диапазоны-аргументы функций без повторов.
+    virtual ShiftedSpan<Range> GetReferencedRanges() const = 0;
+    // Дописывает в out скомпилированную программу формулы (см. RestoreFormula).
+    virtual void SerializeProgram(std::string& out) const = 0;
+
+    // Общий шаблон формулы (см. ParseFormula) или nullptr, если его нет.
+    virtual const FormulaAST* GetTemplate() const;
+    // Даёт ли выражение expression в ячейке этой формулы ту же формулу: тот же
+    // текст со ссылками относительно ячейки, а значит, и тот же шаблон.
+    // Константы при этом сравниваются по записи, а не по округлённой
+    // канонической. false, если совпадение подтвердить нечем.
+    virtual bool IsParsedFrom(std::string_view expression) const;
+    // Вычисляет эту формулу и count - 1 формул того же шаблона под ней в столбце
+    // одним проходом по программе шаблона (ASTImpl::Program::ExecuteRun).
+    // В values[k] - то же значение, что дал бы Evaluate k-й формулы.
+    // Возвращает false, ничего не вычислив, если в шаблоне есть функции
+    // или ссылки на ячейки своего столбца: тогда формулы серии зависели бы
+    // друг от друга.
+    virtual bool EvaluateRun(const SheetInterface& sheet, std::size_t count, std::vector<Value>& values) const;
+};
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+// Формула ячейки anchor. Разобранная формула хранится как шаблон со ссылками
+// относительно ячейки и общая для всех формул с тем же относительным текстом:
+// у столбца формул =A2*B2, =A3*B3, ... один шаблон, а у каждой формулы -
+// только ссылка на него и позиция. Текст и ссылки формулы вычисляются по шаблону.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor);
+
+// Значение ячейки листа для формулы: пустая ячейка - 0, текст - его число
+// (TextAsNumber). Текст, не являющийся числом, и ошибки бросаются как FormulaError.
+double GetCellValueAsDouble(const SheetInterface& sheet, Position pos);
+// Значения диапазона для агрегатных функций (RangeReader): как в электронных
+// таблицах, пустые ячейки и текст, не являющийся числом, пропускаются.
+// Это единственное правило чтения диапазонов, им пользуются все пути вычисления.
+void GetRangeValues(const SheetInterface& sheet, Range range, std::vector<double>& values);
+
+// Число, которым формулы считают текст ячейки, или nullopt, если текст не число.
+// Числом считается запись в виде лексемы NUMBER формул: 12, 1.5, .5, 2e-3.
+std::optional<double> TextAsNumber(std::string_view text);
+
+// Формула из снимка листа: выражение и программа берутся готовыми, без разбора.
+// Программа декодируется при первом вычислении. expression и program указывают
+// в память, которую держит storage. Бросает FormulaException, если программа
+// ссылается на ячейки или диапазоны не из referenced_cells и referenced_ranges.
+std::unique_ptr<FormulaInterface> RestoreFormula(std::shared_ptr<const void> storage,
+                                                 std::string_view expression, std::string_view program,
+                                                 std::vector<Position> referenced_cells,
+                                                 std::vector<Range> referenced_ranges);
+
+// Разобранные формулы кэшируются по тексту выражения, в котором ссылки
+// заменены сдвигами относительно ячейки формулы (LRU): формулы с одинаковым
+// относительным текстом разделяют одну неизменяемую программу-шаблон.
+struct FormulaCacheStats {
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t size = 0;
+    std::size_t capacity = 0;
 };
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+FormulaCacheStats GetFormulaCacheStats();
+// Нулевая ёмкость отключает кэш.
+void SetFormulaCacheCapacity(std::size_t capacity);
+// Очищает кэш и обнуляет счётчики.
+void ClearFormulaCache();
\ No newline at end of file
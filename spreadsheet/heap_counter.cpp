@@ -0,0 +1,89 @@
+#include "heap_counter.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// К каждому блоку приписывается его размер, чтобы учитывать и освобождения.
+std::atomic<std::size_t> live_heap_bytes{0};
+std::atomic<std::size_t> heap_allocations{0};
+std::atomic<std::size_t> live_heap_blocks{0};
+
+namespace {
+    constexpr std::size_t HEAP_HEADER = alignof(std::max_align_t);
+}
+
+void* operator new(std::size_t size) {
+    void* block = std::malloc(size + HEAP_HEADER);
+    if (block == nullptr) throw std::bad_alloc();
+    *static_cast<std::size_t*>(block) = size;
+    live_heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    live_heap_blocks.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<char*>(block) + HEAP_HEADER;
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+    if (pointer == nullptr) return;
+    void* block = static_cast<char*>(pointer) - HEAP_HEADER;
+    live_heap_bytes.fetch_sub(*static_cast<std::size_t*>(block), std::memory_order_relaxed);
+    live_heap_blocks.fetch_sub(1, std::memory_order_relaxed);
+    std::free(block);
+}
+
+void operator delete[](void* pointer) noexcept {
+    operator delete(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    operator delete(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept {
+    operator delete(pointer);
+}
+
+// Выровненные блоки, например плиты пулов листа. Блок берётся с запасом
+// на выравнивание, перед выровненным адресом хранятся исходный указатель и размер.
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    const std::size_t align = std::max(static_cast<std::size_t>(alignment), HEAP_HEADER);
+    void* raw = std::malloc(size + align + 2 * sizeof(std::size_t));
+    if (raw == nullptr) throw std::bad_alloc();
+    const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(raw) + 2 * sizeof(std::size_t);
+    auto* block = reinterpret_cast<std::size_t*>((start + align - 1) / align * align);
+    block[-2] = reinterpret_cast<std::uintptr_t>(raw);
+    block[-1] = size;
+    live_heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    live_heap_blocks.fetch_add(1, std::memory_order_relaxed);
+    return block;
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept {
+    if (pointer == nullptr) return;
+    auto* block = static_cast<std::size_t*>(pointer);
+    live_heap_bytes.fetch_sub(block[-1], std::memory_order_relaxed);
+    live_heap_blocks.fetch_sub(1, std::memory_order_relaxed);
+    std::free(reinterpret_cast<void*>(block[-2]));
+}
+
+void operator delete[](void* pointer, std::align_val_t alignment) noexcept {
+    operator delete(pointer, alignment);
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t alignment) noexcept {
+    operator delete(pointer, alignment);
+}
+
+void operator delete[](void* pointer, std::size_t, std::align_val_t alignment) noexcept {
+    operator delete(pointer, alignment);
+}
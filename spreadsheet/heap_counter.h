@@ -0,0 +1,12 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Счётчики кучи для замеров памяти: занятые байты, число выделений и число
+// занятых блоков. Их ведут глобальные operator new/delete из heap_counter.cpp,
+// который собирается только в цель spreadsheet_bench; у программы с тестами
+// распределитель памяти стандартный.
+extern std::atomic<std::size_t> live_heap_bytes;
+extern std::atomic<std::size_t> heap_allocations;
+extern std::atomic<std::size_t> live_heap_blocks;
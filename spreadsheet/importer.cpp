@@ -0,0 +1,133 @@
+#include "importer.h"
+
+#include <algorithm>
+#include <fstream>
+#include <istream>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+// Разбирает таблицу по мере поступления блоков; поле или строка
+// могут начинаться в одном блоке и заканчиваться в другом.
+class TableParser {
+public:
+    TableParser(TextTableFormat format, std::vector<std::pair<Position, std::string>>& cells)
+    : cells_(cells),
+      separator_(format == TextTableFormat::CSV ? ',' : '\t'),
+      quoting_(format == TextTableFormat::CSV) {}
+
+    void Feed(std::string_view chunk) {
+        if (!quoting_) {
+            FeedPlain(chunk);
+            return;
+        }
+        for (char ch : chunk) {
+            FeedQuoted(ch);
+        }
+    }
+
+    void Finish() {
+        if (in_quotes_) {
+            throw ImportError("Не закрыта кавычка в поле строки "s + std::to_string(row_ + 1));
+        }
+        if (!field_.empty() || col_ > 0) EndRecord();
+    }
+
+private:
+    std::vector<std::pair<Position, std::string>>& cells_;
+    const char separator_;
+    const bool quoting_;
+    std::string field_;
+    bool in_quotes_ = false;
+    bool quote_closed_ = false;
+    int row_ = 0;
+    int col_ = 0;
+
+    void FeedPlain(std::string_view chunk) {
+        while (!chunk.empty()) {
+            const auto end = std::find_if(chunk.begin(), chunk.end(), [this](char ch) {
+                return ch == separator_ || ch == '\n';
+            });
+            field_.append(chunk.begin(), end);
+            if (end == chunk.end()) return;
+            if (*end == separator_) {
+                EndField();
+            } else {
+                EndRecord();
+            }
+            chunk.remove_prefix(end - chunk.begin() + 1);
+        }
+    }
+
+    void FeedQuoted(char ch) {
+        if (in_quotes_) {
+            if (ch == '"') {
+                in_quotes_ = false;
+                quote_closed_ = true;
+            } else {
+                field_ += ch;
+            }
+            return;
+        }
+        if (ch == '"' && quote_closed_) {
+            // Удвоенная кавычка внутри поля в кавычках.
+            field_ += ch;
+            in_quotes_ = true;
+        } else if (ch == '"' && field_.empty()) {
+            in_quotes_ = true;
+        } else if (ch == separator_) {
+            EndField();
+        } else if (ch == '\n') {
+            EndRecord();
+        } else {
+            field_ += ch;
+        }
+        quote_closed_ = false;
+    }
+
+    void EndField() {
+        if (!field_.empty()) {
+            cells_.emplace_back(Position{row_, col_}, std::move(field_));
+            field_.clear();
+        }
+        ++col_;
+    }
+
+    void EndRecord() {
+        if (!field_.empty() && field_.back() == '\r') field_.pop_back();
+        EndField();
+        ++row_;
+        col_ = 0;
+    }
+};
+
+}  // namespace
+
+ImportStats ImportTexts(Sheet& sheet, std::istream& input, TextTableFormat format, unsigned num_threads) {
+    constexpr std::size_t CHUNK_SIZE = 1 << 20;
+
+    ImportStats stats;
+    std::vector<std::pair<Position, std::string>> cells;
+    TableParser parser(format, cells);
+    std::string buffer(CHUNK_SIZE, '\0');
+    while (input.read(buffer.data(), CHUNK_SIZE) || input.gcount() > 0) {
+        const auto size = static_cast<std::size_t>(input.gcount());
+        stats.bytes += size;
+        parser.Feed({buffer.data(), size});
+    }
+    parser.Finish();
+
+    stats.cells = cells.size();
+    sheet.SetCells(std::move(cells), num_threads);
+    return stats;
+}
+
+ImportStats ImportTextsFromFile(Sheet& sheet, const std::string& path, TextTableFormat format, unsigned num_threads) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) throw std::runtime_error("Не удалось открыть файл "s + path);
+    return ImportTexts(sheet, input, format, num_threads);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <cstddef>
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+
+// Формат таблицы текстов ячеек. TSV - то, что печатает PrintTexts: ячейки
+// разделены табуляцией, строки - переводом строки, экранирования нет.
+// CSV разделяет ячейки запятой, поля с запятой, кавычкой или переводом
+// строки заключаются в кавычки, кавычка внутри удваивается.
+enum class TextTableFormat {
+    TSV,
+    CSV,
+};
+
+// Таблица записана с ошибкой, например в CSV не закрыта кавычка.
+class ImportError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct ImportStats {
+    std::size_t bytes = 0;
+    std::size_t cells = 0;
+};
+
+// Читает таблицу крупными блоками и записывает её в лист одним пакетом,
+// начиная с A1. Пустые поля ячеек не создают и существующие не очищают.
+// Формулы разбираются в num_threads потоках. Пакет применяется целиком,
+// поэтому до записи в лист в памяти собираются тексты всех ячеек таблицы:
+// пик памяти - полный текст таблицы. Если таблица записана с ошибкой
+// (ImportError) или в ней есть некорректная формула (FormulaException),
+// лист не меняется.
+ImportStats ImportTexts(Sheet& sheet, std::istream& input,
+                        TextTableFormat format = TextTableFormat::TSV, unsigned num_threads = 1);
+ImportStats ImportTextsFromFile(Sheet& sheet, const std::string& path,
+                                TextTableFormat format = TextTableFormat::TSV, unsigned num_threads = 1);
@@ -0,0 +1,322 @@
+#pragma once
+
+#include "common.h"
+#include "tiled_grid.h"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+// Кратчайшая запись числа без порядка, из которой читается то же число,
+// как его обычно вводят: 100000, 0.00025. Порядок (1e+300) появляется, только
+// если запись без него не помещается в буфер. По ней восстанавливается текст
+// ячейки, хранящейся в числовых столбцах.
+class NumberText {
+public:
+    explicit NumberText(double number) {
+        char* const last = chars_.data() + chars_.size();
+        std::to_chars_result result = std::to_chars(chars_.data(), last, number, std::chars_format::fixed);
+        if (result.ec != std::errc()) result = std::to_chars(chars_.data(), last, number);
+        size_ = static_cast<std::size_t>(result.ptr - chars_.data());
+    }
+
+    std::string_view View() const {
+        return {chars_.data(), size_};
+    }
+
+private:
+    std::array<char, 32> chars_;
+    std::size_t size_;
+};
+
+// Числовые константы листа, разложенные по столбцам (structure of arrays).
+// Столбец разбит на блоки по BLOCK_ROWS строк; в блоке битовая карта занятых
+// строк и массив чисел только этих строк подряд, без объекта ячейки и строки.
+// Блок выделяется при первой записи и освобождается, когда пустеет. Сам блок
+// без чисел занимает около 200 байт, поэтому в плотном столбце число стоит
+// около 8 байт, а одиночное число в полосе из BLOCK_ROWS строк - около 200.
+class NumericColumns {
+    struct Block;
+    struct Column;
+
+public:
+    static constexpr int BLOCK_ROWS = 1024;
+    static constexpr int BANDS = (Position::MAX_ROWS + BLOCK_ROWS - 1) / BLOCK_ROWS;
+
+    // Число в позиции или nullptr.
+    const double* Find(Position pos) const {
+        const Block* block = FindBlock(pos);
+        const int row = pos.row % BLOCK_ROWS;
+        return block != nullptr && block->Has(row) ? &block->values[block->Index(row)] : nullptr;
+    }
+
+    void Set(Position pos, double value) {
+        if (rows_ == nullptr) {
+            rows_ = std::make_unique<OccupancyCounter>(Position::MAX_ROWS);
+            cols_ = std::make_unique<OccupancyCounter>(Position::MAX_COLS);
+        }
+        if (static_cast<int>(columns_.size()) <= pos.col) columns_.resize(pos.col + 1);
+        Column& column = columns_[pos.col];
+        if (column.blocks.empty()) column.blocks.resize(BANDS);
+        auto& block = column.blocks[pos.row / BLOCK_ROWS];
+        if (block == nullptr) {
+            block = std::make_unique<Block>();
+            ++band_blocks_[pos.row / BLOCK_ROWS];
+        }
+        const int row = pos.row % BLOCK_ROWS;
+        if (block->Has(row)) {
+            block->values[block->Index(row)] = value;
+            return;
+        }
+        block->Insert(row, value);
+        ++column.count;
+        ++size_;
+        rows_->Add(pos.row);
+        cols_->Add(pos.col);
+    }
+
+    bool Erase(Position pos) {
+        Block* block = FindBlock(pos);
+        const int row = pos.row % BLOCK_ROWS;
+        if (block == nullptr || !block->Has(row)) return false;
+        block->Remove(row);
+        --size_;
+        rows_->Remove(pos.row);
+        cols_->Remove(pos.col);
+        Column& column = columns_[pos.col];
+        if (block->values.empty()) {
+            column.blocks[pos.row / BLOCK_ROWS].reset();
+            --band_blocks_[pos.row / BLOCK_ROWS];
+        }
+        if (--column.count == 0) column.blocks = std::vector<std::unique_ptr<Block>>();
+        return true;
+    }
+
+    std::size_t Count() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // Размер минимального прямоугольника от A1, содержащего все числа.
+    Size Extent() const {
+        if (Empty()) {
+            return {0, 0};
+        }
+        return {rows_->Max() + 1, cols_->Max() + 1};
+    }
+
+    // Дописывает в values числа из range по столбцам, внутри столбца - по строкам.
+    // Полностью занятые слова битовой карты копируются целиком.
+    void AppendRange(Range range, std::vector<double>& values) const {
+        const int last_col = std::min(range.last.col, static_cast<int>(columns_.size()) - 1);
+        for (int col = range.first.col; col <= last_col; ++col) {
+            const Column& column = columns_[col];
+            if (column.count == 0) continue;
+            for (int band = range.first.row / BLOCK_ROWS; band <= range.last.row / BLOCK_ROWS; ++band) {
+                if (const Block* block = column.blocks[band].get()) {
+                    block->Append(std::max(range.first.row - band * BLOCK_ROWS, 0),
+                                  std::min(range.last.row - band * BLOCK_ROWS + 1, BLOCK_ROWS), values);
+                }
+            }
+        }
+    }
+
+    // Записывает в values[k] число строки top.row + k столбца top.col, если
+    // оно есть, для k < count; остальные элементы values не меняются.
+    void CopyColumn(Position top, std::size_t count, double* values) const {
+        if (top.col >= static_cast<int>(columns_.size()) || columns_[top.col].count == 0) return;
+        const Column& column = columns_[top.col];
+        const int end = top.row + static_cast<int>(count);
+        for (int band = top.row / BLOCK_ROWS; band * BLOCK_ROWS < end; ++band) {
+            if (const Block* block = column.blocks[band].get()) {
+                const int begin = std::max(top.row - band * BLOCK_ROWS, 0);
+                block->Copy(begin, std::min(end - band * BLOCK_ROWS, BLOCK_ROWS),
+                            values + (band * BLOCK_ROWS + begin - top.row));
+            }
+        }
+    }
+
+    // Вызывает func(Position, double) для всех чисел по столбцам.
+    template <typename Func>
+    void ForEach(Func func) const {
+        for (int col = 0; col < static_cast<int>(columns_.size()); ++col) {
+            if (columns_[col].count == 0) continue;
+            for (int band = 0; band < BANDS; ++band) {
+                const Block* block = columns_[col].blocks[band].get();
+                if (block == nullptr) continue;
+                std::size_t index = 0;
+                for (int row = 0; row < BLOCK_ROWS; ++row) {
+                    if (block->Has(row)) func(Position{band * BLOCK_ROWS + row, col}, block->values[index++]);
+                }
+            }
+        }
+    }
+
+    // Обход чисел в порядке строк, а внутри строки - в порядке столбцов,
+    // чтобы сливать его с обходом остальных ячеек листа.
+    class RowCursor {
+    public:
+        explicit RowCursor(const NumericColumns& columns)
+        : columns_(columns) {
+            if (LoadBand(0)) Settle();
+        }
+
+        bool Valid() const {
+            return row_ < Position::MAX_ROWS;
+        }
+
+        Position Pos() const {
+            return {row_, band_cols_[index_]};
+        }
+
+        double Value() const {
+            const Block* block = band_[index_];
+            return block->values[block->Index(row_ % BLOCK_ROWS)];
+        }
+
+        void Next() {
+            ++index_;
+            Settle();
+        }
+
+    private:
+        // Первая полоса начиная с band, где есть блоки.
+        bool LoadBand(int band) {
+            band_.clear();
+            band_cols_.clear();
+            index_ = 0;
+            for (; band < BANDS; ++band) {
+                if (columns_.band_blocks_[band] == 0) continue;
+                for (int col = 0; col < static_cast<int>(columns_.columns_.size()); ++col) {
+                    const Column& column = columns_.columns_[col];
+                    if (column.count > 0 && column.blocks[band] != nullptr) {
+                        band_.push_back(column.blocks[band].get());
+                        band_cols_.push_back(col);
+                    }
+                }
+                row_ = band * BLOCK_ROWS;
+                return true;
+            }
+            row_ = Position::MAX_ROWS;
+            return false;
+        }
+
+        // Сдвигается на ближайшее число, начиная с текущего места.
+        void Settle() {
+            while (true) {
+                for (; index_ < band_.size(); ++index_) {
+                    if (band_[index_]->Has(row_ % BLOCK_ROWS)) return;
+                }
+                index_ = 0;
+                if (++row_ % BLOCK_ROWS == 0 && !LoadBand(row_ / BLOCK_ROWS)) return;
+            }
+        }
+
+        const NumericColumns& columns_;
+        std::vector<const Block*> band_;
+        std::vector<int> band_cols_;
+        std::size_t index_ = 0;
+        int row_ = Position::MAX_ROWS;
+    };
+
+private:
+    static constexpr int WORD_BITS = 64;
+
+    struct Block {
+        static constexpr int WORDS = BLOCK_ROWS / WORD_BITS;
+
+        std::array<std::uint64_t, WORDS> present{};
+        // Число занятых строк в словах карты до каждого слова.
+        std::array<std::uint16_t, WORDS> before{};
+        // Числа занятых строк по возрастанию строк.
+        std::vector<double> values;
+
+        bool Has(int row) const {
+            return (present[row / WORD_BITS] >> row % WORD_BITS & 1) != 0;
+        }
+
+        // Место числа строки row (или строки, которой нет, - куда его вставить) в values.
+        std::size_t Index(int row) const {
+            const std::uint64_t lower = (std::uint64_t{1} << row % WORD_BITS) - 1;
+            return before[row / WORD_BITS] + std::bitset<WORD_BITS>(present[row / WORD_BITS] & lower).count();
+        }
+
+        void Insert(int row, double value) {
+            values.insert(values.begin() + Index(row), value);
+            present[row / WORD_BITS] |= std::uint64_t{1} << row % WORD_BITS;
+            for (int word = row / WORD_BITS + 1; word < WORDS; ++word) ++before[word];
+        }
+
+        void Remove(int row) {
+            values.erase(values.begin() + Index(row));
+            present[row / WORD_BITS] &= ~(std::uint64_t{1} << row % WORD_BITS);
+            for (int word = row / WORD_BITS + 1; word < WORDS; ++word) --before[word];
+            if (values.empty()) values.shrink_to_fit();
+        }
+
+        void Append(int begin, int end, std::vector<double>& out) const {
+            std::size_t index = Index(begin);
+            for (int row = begin; row < end;) {
+                const int word_end = std::min(end, (row / WORD_BITS + 1) * WORD_BITS);
+                if (word_end - row == WORD_BITS && present[row / WORD_BITS] == ~std::uint64_t{0}) {
+                    out.insert(out.end(), values.begin() + index, values.begin() + index + WORD_BITS);
+                    index += WORD_BITS;
+                } else {
+                    for (; row < word_end; ++row) {
+                        if (Has(row)) out.push_back(values[index++]);
+                    }
+                }
+                row = word_end;
+            }
+        }
+
+        // Копирует числа строк [begin, end) в out, out[0] - строка begin.
+        void Copy(int begin, int end, double* out) const {
+            std::size_t index = Index(begin);
+            for (int row = begin; row < end;) {
+                const int word_end = std::min(end, (row / WORD_BITS + 1) * WORD_BITS);
+                if (present[row / WORD_BITS] == ~std::uint64_t{0}) {
+                    std::copy(values.begin() + index, values.begin() + index + (word_end - row), out + (row - begin));
+                    index += word_end - row;
+                } else {
+                    for (; row < word_end; ++row) {
+                        if (Has(row)) out[row - begin] = values[index++];
+                    }
+                }
+                row = word_end;
+            }
+        }
+    };
+
+    struct Column {
+        // BANDS блоков или пусто, если в столбце нет чисел.
+        std::vector<std::unique_ptr<Block>> blocks;
+        int count = 0;
+    };
+
+    const Block* FindBlock(Position pos) const {
+        if (pos.col >= static_cast<int>(columns_.size()) || columns_[pos.col].count == 0) return nullptr;
+        return columns_[pos.col].blocks[pos.row / BLOCK_ROWS].get();
+    }
+
+    Block* FindBlock(Position pos) {
+        return const_cast<Block*>(std::as_const(*this).FindBlock(pos));
+    }
+
+    std::vector<Column> columns_;
+    // Количество блоков в каждой полосе из BLOCK_ROWS строк.
+    std::array<int, BANDS> band_blocks_{};
+    std::unique_ptr<OccupancyCounter> rows_;
+    std::unique_ptr<OccupancyCounter> cols_;
+    std::size_t size_ = 0;
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+
+// Множество позиций для связей между ячейками. Позиции лежат подряд
+// в порядке добавления; до INLINE_CAPACITY штук - прямо в объекте, без
+// выделений памяти. Большим множествам, например у ячейки, на которую
+// ссылаются тысячи формул, заводится хеш-индекс позиций, чтобы удаление
+// оставалось быстрым.
+class PositionSet {
+public:
+    static constexpr std::uint32_t INLINE_CAPACITY = 2;
+    static constexpr std::uint32_t INDEX_THRESHOLD = 32;
+
+    PositionSet() = default;
+
+    // Позиции из диапазона должны быть различны.
+    template <typename It>
+    PositionSet(It begin, It end) {
+        Reserve(static_cast<std::uint32_t>(std::distance(begin, end)));
+        for (; begin != end; ++begin) {
+            Data()[size_++] = *begin;
+        }
+        if (size_ > INDEX_THRESHOLD) BuildIndex();
+    }
+
+    PositionSet(PositionSet&& other) noexcept {
+        MoveFrom(other);
+    }
+
+    PositionSet& operator=(PositionSet&& other) noexcept {
+        if (this != &other) {
+            Release();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    PositionSet(const PositionSet&) = delete;
+    PositionSet& operator=(const PositionSet&) = delete;
+
+    ~PositionSet() {
+        Release();
+    }
+
+    const Position* begin() const {
+        return Data();
+    }
+
+    const Position* end() const {
+        return Data() + size_;
+    }
+
+    std::size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    bool Contains(Position pos) const {
+        if (index_) return index_->count(pos) > 0;
+        return std::find(begin(), end(), pos) != end();
+    }
+
+    bool Insert(Position pos) {
+        if (Contains(pos)) return false;
+        if (size_ == capacity_) Reserve(capacity_ * 2);
+        Data()[size_] = pos;
+        if (index_) {
+            index_->emplace(pos, size_);
+        } else if (size_ + 1 > INDEX_THRESHOLD) {
+            ++size_;
+            BuildIndex();
+            return true;
+        }
+        ++size_;
+        return true;
+    }
+
+    // Последняя позиция занимает место удалённой.
+    bool Erase(Position pos) {
+        std::uint32_t slot;
+        if (index_) {
+            auto it = index_->find(pos);
+            if (it == index_->end()) return false;
+            slot = it->second;
+            index_->erase(it);
+        } else {
+            const Position* found = std::find(begin(), end(), pos);
+            if (found == end()) return false;
+            slot = static_cast<std::uint32_t>(found - begin());
+        }
+        Position* data = Data();
+        if (slot + 1 != size_) {
+            data[slot] = data[size_ - 1];
+            if (index_) (*index_)[data[slot]] = slot;
+        }
+        --size_;
+        return true;
+    }
+
+private:
+    std::uint32_t size_ = 0;
+    std::uint32_t capacity_ = INLINE_CAPACITY;
+    union Storage {
+        Storage()
+        : heap(nullptr) {}
+
+        Position* heap;
+        Position inline_positions[INLINE_CAPACITY];
+    } storage_;
+    std::unique_ptr<std::unordered_map<Position, std::uint32_t>> index_;
+
+    bool IsInline() const {
+        return capacity_ == INLINE_CAPACITY;
+    }
+
+    Position* Data() {
+        return IsInline() ? storage_.inline_positions : storage_.heap;
+    }
+
+    const Position* Data() const {
+        return IsInline() ? storage_.inline_positions : storage_.heap;
+    }
+
+    void Reserve(std::uint32_t capacity) {
+        if (capacity <= capacity_) return;
+        Position* data = new Position[capacity];
+        std::copy(begin(), end(), data);
+        if (!IsInline()) delete[] storage_.heap;
+        storage_.heap = data;
+        capacity_ = capacity;
+    }
+
+    void BuildIndex() {
+        index_ = std::make_unique<std::unordered_map<Position, std::uint32_t>>();
+        index_->reserve(size_);
+        for (std::uint32_t slot = 0; slot < size_; ++slot) {
+            index_->emplace(Data()[slot], slot);
+        }
+    }
+
+    void Release() {
+        if (!IsInline()) delete[] storage_.heap;
+        capacity_ = INLINE_CAPACITY;
+        size_ = 0;
+        index_.reset();
+    }
+
+    void MoveFrom(PositionSet& other) {
+        size_ = other.size_;
+        capacity_ = other.capacity_;
+        index_ = std::move(other.index_);
+        if (other.IsInline()) {
+            std::copy(other.begin(), other.end(), storage_.inline_positions);
+        } else {
+            storage_.heap = other.storage_.heap;
+        }
+        other.capacity_ = INLINE_CAPACITY;
+        other.size_ = 0;
+    }
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Ссылки формул на диапазоны: по позиции ячейки находит формулы, в диапазоны
+// которых она входит. Каждая ссылка хранится одной записью, сколько бы ячеек
+// ни было в диапазоне.
+//
+// Многоуровневая сетка: на уровне (i, j) лист разбит на блоки по 2^i строк
+// и 2^j столбцов. Диапазон хранится на уровне, где блок не меньше его самого,
+// в блоке своего левого верхнего угла, и поэтому задевает не больше двух
+// блоков по каждой оси. Запрос проверяет по четыре блока на каждом уровне,
+// где есть записи.
+class RangeIndex {
+public:
+    void Insert(Range range, Position dependent) {
+        const Place place = PlaceOf(range);
+        buckets_[place.key].push_back({range, dependent});
+        if (level_sizes_[place.level]++ == 0) {
+            row_levels_[place.level / LEVELS] |= LevelBit(place.level % LEVELS);
+        }
+        ++size_;
+    }
+
+    // Удаляет одну запись (range, dependent), если она есть.
+    bool Erase(Range range, Position dependent) {
+        const Place place = PlaceOf(range);
+        auto bucket = buckets_.find(place.key);
+        if (bucket == buckets_.end()) return false;
+        std::vector<Entry>& entries = bucket->second;
+        for (Entry& entry : entries) {
+            if (entry.range == range && entry.dependent == dependent) {
+                entry = entries.back();
+                entries.pop_back();
+                if (entries.empty()) buckets_.erase(bucket);
+                if (--level_sizes_[place.level] == 0) {
+                    row_levels_[place.level / LEVELS] &= ~LevelBit(place.level % LEVELS);
+                }
+                --size_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Вызывает func(Position) для формулы каждой записи, диапазон которой содержит pos.
+    // Формула с несколькими такими диапазонами встречается несколько раз.
+    template <typename Func>
+    void ForEachDependent(Position pos, Func func) const {
+        if (size_ == 0) return;
+        for (int row_level = 0; row_level < LEVELS; ++row_level) {
+            for (std::uint32_t cols = row_levels_[row_level]; cols != 0; cols &= cols - 1) {
+                const int col_level = LowestBit(cols);
+                const int row_block = pos.row >> row_level;
+                const int col_block = pos.col >> col_level;
+                for (int row = row_block; row >= row_block - 1 && row >= 0; --row) {
+                    for (int col = col_block; col >= col_block - 1 && col >= 0; --col) {
+                        auto bucket = buckets_.find(Key(row_level * LEVELS + col_level, row, col));
+                        if (bucket == buckets_.end()) continue;
+                        for (const Entry& entry : bucket->second) {
+                            if (entry.range.Contains(pos)) func(entry.dependent);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    bool HasDependents(Position pos) const {
+        bool found = false;
+        ForEachDependent(pos, [&found](Position) {
+            found = true;
+        });
+        return found;
+    }
+
+    std::size_t Size() const {
+        return size_;
+    }
+
+private:
+    // Уровни по одной оси: блоки от 1 до 2^14 = 16384 строк или столбцов.
+    static constexpr int LEVELS = 15;
+    static_assert(Position::MAX_ROWS <= 1 << (LEVELS - 1) && Position::MAX_COLS <= 1 << (LEVELS - 1));
+
+    struct Entry {
+        Range range;
+        Position dependent;
+    };
+
+    struct Place {
+        int level;
+        std::uint64_t key;
+    };
+
+    static std::uint64_t Key(int level, int row_block, int col_block) {
+        return (std::uint64_t{static_cast<std::uint32_t>(level)} << 32)
+               | (std::uint64_t{static_cast<std::uint32_t>(row_block)} << 16)
+               | static_cast<std::uint32_t>(col_block);
+    }
+
+    // Наименьший уровень, блок которого вмещает span строк или столбцов.
+    static int LevelOf(int span) {
+        int level = 0;
+        while ((1 << level) < span) {
+            ++level;
+        }
+        return level;
+    }
+
+    static Place PlaceOf(Range range) {
+        const int row_level = LevelOf(range.last.row - range.first.row + 1);
+        const int col_level = LevelOf(range.last.col - range.first.col + 1);
+        const int level = row_level * LEVELS + col_level;
+        return {level, Key(level, range.first.row >> row_level, range.first.col >> col_level)};
+    }
+
+    static std::uint32_t LevelBit(int level) {
+        return std::uint32_t{1} << level;
+    }
+
+    static int LowestBit(std::uint32_t bits) {
+        int bit = 0;
+        while ((bits & 1) == 0) {
+            bits >>= 1;
+            ++bit;
+        }
+        return bit;
+    }
+
+    std::unordered_map<std::uint64_t, std::vector<Entry>> buckets_;
+    // Число записей на каждом уровне и, для каждого уровня по строкам,
+    // битовая маска уровней по столбцам, на которых записи есть.
+    std::array<std::uint32_t, LEVELS * LEVELS> level_sizes_{};
+    std::array<std::uint32_t, LEVELS> row_levels_{};
+    std::size_t size_ = 0;
+};
@@ -2,7 +2,16 @@
 #include "cell.h"
 #include "common.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <exception>
 #include <iostream>
+#include <locale>
+#include <mutex>
+#include <system_error>
+#include <thread>
 
 using namespace std::literals;
 
@@ -10,91 +19,964 @@ Sheet::~Sheet() {}
 
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) throw InvalidPositionException("Недопустимая позиция ячейки."s);
-    Cell* cell_existing = static_cast<Cell*>(GetCell(pos));
+    if (batch_depth_ > 0) {
+        // Правка той же ячейки раньше в пакете могла изменить её текст.
+        if (batch_index_.count(pos) == 0 && HasText(pos, text)) return;
+        AddBatchEdit(MakeBatchEdit(pos, std::move(text), false));
+        return;
+    }
+    if (HasText(pos, text)) return;
+    Cell* cell_existing = FindCell(pos);
     if (cell_existing == nullptr) {
-        std::unique_ptr<Cell> cell = std::make_unique<Cell>(*this, pos);
+        if (std::optional<double> number = ConstantNumber(text)) {
+            SetNumber(pos, *number);
+            InvalidateRangeDependents(pos);
+            return;
+        }
+        std::unique_ptr<Cell> cell = NewCell(pos);
         cell->Set(text);
-        data_[pos] = std::move(cell);
+        EraseNumber(pos);
+        data_.Set(pos, std::move(cell));
     } else {
-        if (cell_existing->GetText() == text) return;
         cell_existing->Set(text);
     }
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     if (!pos.IsValid()) throw InvalidPositionException("Недопустимая позиция ячейки."s);
-    if (data_.count(pos) > 0) {
-        return data_.at(pos).get();
-    } else {
-        return nullptr;
-    }
+    if (Cell* cell = FindCell(pos)) return cell;
+    if (const double* number = numbers_.Find(pos)) return ViewNumber(pos, *number);
+    return nullptr;
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
     if (!pos.IsValid()) throw InvalidPositionException("Недопустимая позиция ячейки."s);
-    if (data_.count(pos) > 0) {
-        return data_[pos].get();
-    } else {
-        return nullptr;
-    }
+    if (Cell* cell = FindCell(pos)) return cell;
+    if (const double* number = numbers_.Find(pos)) return ViewNumber(pos, *number);
+    return nullptr;
+}
+
+std::optional<double> Sheet::GetStoredNumber(Position pos) const {
+    if (!pos.IsValid()) return std::nullopt;
+    if (const double* number = numbers_.Find(pos)) return *number;
+    return std::nullopt;
+}
+
+void Sheet::GetRangeCells(Range range, std::vector<double>& numbers, std::vector<const CellInterface*>& cells) const {
+    numbers_.AppendRange(range, numbers);
+    data_.ForEachInRange(range, [&cells](Position, const std::unique_ptr<Cell>& cell) {
+        cells.push_back(cell.get());
+    });
+}
+
+void Sheet::GetColumnCells(Position top, std::size_t count, double* numbers, const CellInterface** cells) const {
+    std::fill(numbers, numbers + count, 0.0);
+    std::fill(cells, cells + count, nullptr);
+    if (count == 0) return;
+    numbers_.CopyColumn(top, count, numbers);
+    const Range column{top, {top.row + static_cast<int>(count) - 1, top.col}};
+    data_.ForEachInRange(column, [top, cells](Position pos, const std::unique_ptr<Cell>& cell) {
+        cells[pos.row - top.row] = cell.get();
+    });
 }
 
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) throw InvalidPositionException("Недопустимая позиция ячейки."s);
-    if (data_.count(pos) > 0) {
-        data_[pos]->Clear();
-        data_.erase(pos);
+    if (batch_depth_ > 0) {
+        AddBatchEdit(MakeBatchEdit(pos, ""s, true));
+        return;
+    }
+    if (EraseNumber(pos)) {
+        InvalidateRangeDependents(pos);
+        return;
+    }
+    if (const auto& cell = data_.Get(pos)) {
+        cell->Clear();
+        // Ячейка, на которую ссылаются формулы, остаётся пустой, как и ячейки,
+        // созданные для ссылок: иначе её зависимые потеряли бы обратные связи.
+        if (cell->cells_referring_me_.Empty()) data_.Erase(pos);
     }
 }
 
-Size Sheet::GetPrintableSize() const {
-    if (data_.empty()) return {0,0};
-    int max_row = 0;
-    int max_col = 0;
-    for (auto& it : data_) {
-        max_row = std::max(max_row, it.first.row);
-        max_col = std::max(max_col, it.first.col);
+void Sheet::BeginBatch() {
+    ++batch_depth_;
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells, unsigned num_threads) {
+    for (const auto& [pos, text] : cells) {
+        if (!pos.IsValid()) throw InvalidPositionException("Недопустимая позиция ячейки."s);
+    }
+
+    // Каждый поток разбирает свой отрезок ячеек. Из ошибок разбора
+    // сообщается о первой по порядку ячеек, как при последовательных SetCell.
+    // Текст, совпадающий с текстом ячейки, не разбирается: правка остаётся
+    // без содержимого, и её пропускают, если раньше ячейку не правили.
+    // Сравнивается до запуска потоков, так как текст формулы строится при первом чтении.
+    std::vector<bool> unchanged(cells.size());
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+        unchanged[i] = HasText(cells[i].first, cells[i].second);
+    }
+    std::vector<BatchEdit> edits(cells.size());
+    const std::size_t thread_count = std::max<std::size_t>(1, std::min<std::size_t>(num_threads, cells.size()));
+    std::vector<std::exception_ptr> errors(thread_count);
+    auto work = [&](std::size_t thread_index) {
+        const std::size_t end = cells.size() * (thread_index + 1) / thread_count;
+        for (std::size_t i = cells.size() * thread_index / thread_count; i < end; ++i) {
+            try {
+                if (unchanged[i]) {
+                    edits[i].pos = cells[i].first;
+                    edits[i].text = std::move(cells[i].second);
+                    continue;
+                }
+                edits[i] = MakeBatchEdit(cells[i].first, std::move(cells[i].second), false);
+            } catch (...) {
+                errors[thread_index] = std::current_exception();
+                return;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (std::size_t thread_index = 1; thread_index < thread_count; ++thread_index) {
+        try {
+            threads.emplace_back(work, thread_index);
+        } catch (const std::system_error&) {
+            work(thread_index);
+        }
+    }
+    work(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (const std::exception_ptr& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+
+    BeginBatch();
+    for (BatchEdit& edit : edits) {
+        if (edit.impl == nullptr) {
+            if (batch_index_.count(edit.pos) == 0) continue;
+            edit = MakeBatchEdit(edit.pos, std::move(edit.text), false);
+        }
+        AddBatchEdit(std::move(edit));
+    }
+    CommitBatch();
+}
+
+bool Sheet::HasText(Position pos, std::string_view text) const {
+    if (const Cell* cell = FindCell(pos)) return cell->HasText(text);
+    const double* stored = numbers_.Find(pos);
+    return stored != nullptr && NumberText(*stored).View() == text;
+}
+
+Sheet::BatchEdit Sheet::MakeBatchEdit(Position pos, std::string text, bool clear) {
+    BatchEdit edit{pos, std::move(text), nullptr, {}, clear, std::nullopt};
+    if (!clear) edit.number = ConstantNumber(edit.text);
+    edit.impl = Cell::MakeImpl(impl_pool_, edit.text, pos);
+    const ShiftedSpan<Position> positions = edit.impl->GetReferencedCells();
+    edit.precedents = Cell::PositionsSet(positions.begin(), positions.end());
+    return edit;
+}
+
+void Sheet::AddBatchEdit(BatchEdit edit) {
+    auto [it, inserted] = batch_index_.emplace(edit.pos, batch_.size());
+    if (inserted) {
+        batch_.push_back(std::move(edit));
+    } else {
+        batch_[it->second] = std::move(edit);
+    }
+}
+
+void Sheet::CommitBatch() {
+    if (batch_depth_ == 0) throw std::logic_error("CommitBatch без BeginBatch"s);
+    if (--batch_depth_ > 0) return;
+    std::vector<BatchEdit> edits = std::move(batch_);
+    batch_.clear();
+    batch_index_.clear();
+
+    // Правки применяются сразу все: сначала содержимое, затем обратные связи,
+    // вместе с которыми создаются ячейки, на которые появились ссылки.
+    struct Applied {
+        Cell* cell;
+        bool created;
+        bool clear;
+        std::unique_ptr<CellImpl> old_impl;
+        Cell::PositionsSet old_precedents;
+    };
+    std::vector<Applied> applied;
+    applied.reserve(edits.size());
+    // Числа в позициях без объектов ячеек правятся прямо в numbers_;
+    // для отката запоминаются прежние значения.
+    std::vector<std::pair<Position, std::optional<double>>> number_edits;
+    // Числа, перенесённые из numbers_ в ячейки ради пакета.
+    std::vector<std::pair<Position, double>> materialized;
+    auto cell_from_number = [&](Position pos) -> Cell* {
+        const double* stored = numbers_.Find(pos);
+        if (stored == nullptr) return nullptr;
+        materialized.emplace_back(pos, *stored);
+        return CellFromNumber(pos);
+    };
+    for (BatchEdit& edit : edits) {
+        Cell* cell = FindCell(edit.pos);
+        if (cell == nullptr) {
+            const double* stored = numbers_.Find(edit.pos);
+            if (edit.clear || edit.number) {
+                // Очистка пустой позиции и запись того же числа ничего не меняют.
+                if (stored == nullptr ? edit.clear : !edit.clear && NumberText(*stored).View() == edit.text) continue;
+                number_edits.emplace_back(edit.pos, stored != nullptr ? std::optional<double>(*stored) : std::nullopt);
+                // Представления удалённых чисел удаляются после применения
+                // пакета: при откате число вернётся на место.
+                if (edit.clear) {
+                    numbers_.Erase(edit.pos);
+                } else {
+                    SetNumber(edit.pos, *edit.number);
+                }
+                continue;
+            }
+            cell = cell_from_number(edit.pos);
+        }
+        if (cell == nullptr) {
+            auto created = NewCell(edit.pos);
+            cell = created.get();
+            data_.Set(edit.pos, std::move(created));
+            applied.push_back({cell, true, false, nullptr, {}});
+        } else {
+            if (!edit.clear && cell->HasText(edit.text)) continue;
+            cell->RemoveDependencies();
+            applied.push_back({cell, false, edit.clear, std::move(cell->impl_), std::move(cell->cells_referring_by_me_)});
+        }
+        cell->impl_ = std::move(edit.impl);
+        cell->cells_referring_by_me_ = std::move(edit.precedents);
+    }
+    std::vector<Position> placeholders;
+    for (const Applied& change : applied) {
+        for (Position pos : change.cell->cells_referring_by_me_) {
+            Cell* precedent = FindCell(pos);
+            if (precedent == nullptr) precedent = cell_from_number(pos);
+            if (precedent == nullptr) {
+                auto created = NewCell(pos);
+                precedent = created.get();
+                data_.Set(pos, std::move(created));
+                placeholders.push_back(pos);
+            }
+            precedent->cells_referring_me_.Insert(change.cell->position_);
+        }
+        AddRangeDependencies(*change.cell);
+    }
+
+    // Ячейки, зависящие от изменённых, заново упорядочиваются алгоритмом Кана
+    // и ставятся в конец топологического порядка: все остальные ячейки
+    // предшествуют им. Цикл может пройти только через изменённую ячейку,
+    // поэтому он весь лежит среди них и не даёт Кану упорядочить их все.
+    const std::uint32_t generation = StartGraphVisit().generation;
+    std::vector<Cell*> affected;
+    auto add_affected = [&](Cell& cell) {
+        if (cell.visit_mark_ != generation) {
+            cell.visit_mark_ = generation;
+            affected.push_back(&cell);
+        }
+    };
+    for (const Applied& change : applied) {
+        add_affected(*change.cell);
+    }
+    for (const auto& [pos, old_number] : number_edits) {
+        range_index_.ForEachDependent(pos, [&](Position dependent) {
+            if (Cell* cell = FindCell(dependent)) add_affected(*cell);
+        });
+    }
+    for (std::size_t i = 0; i < affected.size(); ++i) {
+        ForEachDependent(*affected[i], add_affected);
+    }
+
+    // Связь через несколько диапазонов считается столько раз, сколько раз
+    // её перечисляют оба обхода, поэтому счётчики сходятся.
+    std::vector<Cell*> sorted;
+    sorted.reserve(affected.size());
+    for (Cell* cell : affected) {
+        cell->scratch_ = 0;
+        ForEachPrecedent(*cell, [&](const Cell& precedent) {
+            if (precedent.visit_mark_ == generation) ++cell->scratch_;
+        });
+        if (cell->scratch_ == 0) sorted.push_back(cell);
+    }
+    for (std::size_t i = 0; i < sorted.size(); ++i) {
+        ForEachDependent(*sorted[i], [&](Cell& dependent) {
+            if (--dependent.scratch_ == 0) sorted.push_back(&dependent);
+        });
+    }
+
+    if (sorted.size() < affected.size()) {
+        std::string cycle;
+        for (const Applied& change : applied) {
+            if (change.cell->scratch_ == 0) continue;
+            cycle += (cycle.empty() ? ": "s : ", "s) + change.cell->position_.ToString();
+        }
+        // Откат: связи пакета снимаются целиком, и только потом возвращаются прежние.
+        for (const Applied& change : applied) {
+            change.cell->RemoveDependencies();
+        }
+        for (Position pos : placeholders) {
+            data_.Erase(pos);
+        }
+        for (Applied& change : applied) {
+            if (change.created) {
+                data_.Erase(change.cell->position_);
+                continue;
+            }
+            change.cell->impl_ = std::move(change.old_impl);
+            change.cell->cells_referring_by_me_ = std::move(change.old_precedents);
+            change.cell->AddDependencies();
+        }
+        for (const auto& [pos, number] : materialized) {
+            data_.Erase(pos);
+            numbers_.Set(pos, number);
+        }
+        for (auto it = number_edits.rbegin(); it != number_edits.rend(); ++it) {
+            if (it->second) {
+                SetNumber(it->first, *it->second);
+            } else {
+                numbers_.Erase(it->first);
+            }
+        }
+        throw CircularDependencyException("Circular dependency was found"s + cycle);
+    }
+    for (const auto& [pos, number] : materialized) {
+        DropNumberView(pos);
+    }
+    for (const auto& [pos, old_number] : number_edits) {
+        if (numbers_.Find(pos) == nullptr) DropNumberView(pos);
+    }
+
+    // Каждая затронутая ячейка сбрасывается ровно один раз.
+    for (Cell* cell : sorted) {
+        cell->order_ = ++last_order_;
+        cell->impl_->InvalidateCache();
+        if (cell->IsStale()) MarkDirty(*cell);
+    }
+    for (const Applied& change : applied) {
+        if (change.clear && change.cell->cells_referring_me_.Empty()) data_.Erase(change.cell->position_);
+    }
+}
+
+Cell* Sheet::FindCell(Position pos) const {
+    return data_.Get(pos).get();
+}
+
+std::optional<double> Sheet::ConstantNumber(std::string_view text) {
+    std::optional<double> number = TextAsNumber(text);
+    if (number && NumberText(*number).View() == text) return number;
+    return std::nullopt;
+}
+
+std::unique_ptr<Cell> Sheet::NewCell(Position pos) {
+    return std::unique_ptr<Cell>(new (cell_pool_) Cell(*this, pos));
+}
+
+SlabPool& Sheet::ImplPool() {
+    return impl_pool_;
+}
+
+Cell* Sheet::CellFromNumber(Position pos) {
+    const double* number = numbers_.Find(pos);
+    if (number == nullptr) return nullptr;
+    auto cell = NewCell(pos);
+    cell->impl_.reset(new (impl_pool_) TextImpl(std::string(NumberText(*number).View())));
+    numbers_.Erase(pos);
+    Cell* result = cell.get();
+    data_.Set(pos, std::move(cell));
+    return result;
+}
+
+Cell& Sheet::ReferencedCell(Position pos) {
+    if (Cell* cell = FindCell(pos)) return *cell;
+    if (Cell* cell = CellFromNumber(pos)) {
+        DropNumberView(pos);
+        return *cell;
+    }
+    auto created = NewCell(pos);
+    Cell* cell = created.get();
+    data_.Set(pos, std::move(created));
+    return *cell;
+}
+
+Sheet::NumberView* Sheet::ViewNumber(Position pos, double number) const {
+    // Константный GetCell могут вызывать одновременно из нескольких потоков.
+    std::lock_guard lock(number_views_mutex_);
+    std::unique_ptr<NumberView>& view = number_views_[pos];
+    if (view == nullptr) view = std::make_unique<NumberView>(number);
+    return view.get();
+}
+
+void Sheet::SetNumber(Position pos, double number) {
+    numbers_.Set(pos, number);
+    if (number_views_.empty()) return;
+    const auto it = number_views_.find(pos);
+    if (it != number_views_.end()) it->second->Set(number);
+}
+
+bool Sheet::EraseNumber(Position pos) {
+    if (!numbers_.Erase(pos)) return false;
+    DropNumberView(pos);
+    return true;
+}
+
+void Sheet::DropNumberView(Position pos) {
+    if (!number_views_.empty()) number_views_.erase(pos);
+}
+
+void Sheet::InvalidateRangeDependents(Position pos) {
+    range_index_.ForEachDependent(pos, [this](Position dependent_pos) {
+        Cell* dependent = FindCell(dependent_pos);
+        if (dependent != nullptr && dependent->impl_->HasCache()) {
+            dependent->InvalidateCache();
+            MarkDirty(*dependent);
+        }
+    });
+}
+
+bool Sheet::HasDependents(const Cell& cell) const {
+    return !cell.cells_referring_me_.Empty() || range_index_.HasDependents(cell.position_);
+}
+
+void Sheet::AddRangeDependencies(const Cell& cell) {
+    for (const Range& range : cell.GetPrecedentRanges()) {
+        range_index_.Insert(range, cell.position_);
+    }
+}
+
+void Sheet::RemoveRangeDependencies(const Cell& cell) {
+    for (const Range& range : cell.GetPrecedentRanges()) {
+        range_index_.Erase(range, cell.position_);
+    }
+}
+
+void Sheet::MarkDirty(Cell& cell) {
+    if (cell.queued_) return;
+    if (dirty_.size() >= dirty_limit_) CompactDirty();
+    cell.queued_ = true;
+    dirty_.push_back(cell.GetPosition());
+}
+
+std::size_t Sheet::DirtyCount() const {
+    return dirty_.size();
+}
+
+void Sheet::CompactDirty() {
+    auto computed = [this](Position pos) {
+        Cell* cell = FindCell(pos);
+        if (cell == nullptr) return true;
+        if (cell->IsStale()) return false;
+        cell->queued_ = false;
+        return true;
+    };
+    dirty_.erase(std::remove_if(dirty_.begin(), dirty_.end(), computed), dirty_.end());
+    // Следующая чистка - когда очередь вырастет вдвое: в среднем на правку
+    // приходится постоянная работа.
+    dirty_limit_ = std::max(MIN_DIRTY_LIMIT, 2 * dirty_.size());
+}
+
+void Sheet::Recalculate(unsigned num_threads) {
+    std::vector<const Cell*> roots;
+    for (Position pos : dirty_) {
+        Cell* cell = FindCell(pos);
+        if (cell == nullptr) continue;
+        cell->queued_ = false;
+        if (cell->IsStale()) roots.push_back(cell);
+    }
+    dirty_.clear();
+    dirty_limit_ = MIN_DIRTY_LIMIT;
+    std::vector<const Cell*> order = EvaluationOrder(roots);
+    if (num_threads > 1) {
+        EvaluateParallel(order, num_threads);
+    } else {
+        EvaluateInRuns(order, true);
+    }
+}
+
+void Sheet::Compute(const Cell& cell) {
+    // Ячейки под cell, скорее всего, будут прочитаны следом (печать,
+    // обход столбца), поэтому серия захватывает и их.
+    EvaluateInRuns(EvaluationOrder({&cell}), true);
+}
+
+Sheet::GraphVisit Sheet::StartGraphVisit() const {
+    if (++visit_generation_ == 0) {
+        // Счётчик обходов переполнился: старые метки могли бы совпасть с новыми.
+        data_.ForEach([](Position, const std::unique_ptr<Cell>& cell) {
+            cell->visit_mark_ = 0;
+        });
+        visit_generation_ = 1;
     }
-    return {max_row + 1, max_col + 1};
+    visit_stack_.clear();
+    return {visit_generation_, visit_stack_};
+}
+
+void Sheet::PlaceFirst(Cell& cell) {
+    cell.order_ = --first_order_;
 }
 
+void Sheet::PlaceLast(Cell& cell) {
+    cell.order_ = ++last_order_;
+}
+
+bool Sheet::KeepOrdered(const Cell& precedent, const Cell& dependent) {
+    if (precedent.order_ < dependent.order_) return true;
+    const std::int64_t lower = dependent.order_;
+    const std::int64_t upper = precedent.order_;
+
+    // Вперёд от dependent по ячейкам с порядком меньше upper: путь к precedent,
+    // если он есть, проходит только по ним.
+    GraphVisit forward = StartGraphVisit();
+    shifted_forward_.clear();
+    dependent.visit_mark_ = forward.generation;
+    forward.stack.push_back(&dependent);
+    bool cycle = false;
+    while (!forward.stack.empty() && !cycle) {
+        const Cell* cell = forward.stack.back();
+        forward.stack.pop_back();
+        shifted_forward_.push_back(cell);
+        ForEachDependent(*cell, [&](const Cell& next) {
+            if (&next == &precedent) {
+                cycle = true;
+            } else if (next.order_ < upper && next.visit_mark_ != forward.generation) {
+                next.visit_mark_ = forward.generation;
+                forward.stack.push_back(&next);
+            }
+        });
+    }
+    if (cycle) return false;
+
+    // Назад от precedent по ячейкам с порядком больше lower.
+    GraphVisit backward = StartGraphVisit();
+    shifted_backward_.clear();
+    precedent.visit_mark_ = backward.generation;
+    backward.stack.push_back(&precedent);
+    while (!backward.stack.empty()) {
+        const Cell* cell = backward.stack.back();
+        backward.stack.pop_back();
+        shifted_backward_.push_back(cell);
+        ForEachPrecedent(*cell, [&](const Cell& next) {
+            if (next.order_ > lower && next.visit_mark_ != backward.generation) {
+                next.visit_mark_ = backward.generation;
+                backward.stack.push_back(&next);
+            }
+        });
+    }
+
+    // Найденные ячейки занимают те же номера, но предшественники идут первыми,
+    // а внутри каждой группы сохраняется прежний относительный порядок.
+    auto by_order = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ < rhs->order_;
+    };
+    std::sort(shifted_forward_.begin(), shifted_forward_.end(), by_order);
+    std::sort(shifted_backward_.begin(), shifted_backward_.end(), by_order);
+    shifted_orders_.clear();
+    for (const Cell* cell : shifted_backward_) shifted_orders_.push_back(cell->order_);
+    for (const Cell* cell : shifted_forward_) shifted_orders_.push_back(cell->order_);
+    std::sort(shifted_orders_.begin(), shifted_orders_.end());
+
+    auto order = shifted_orders_.begin();
+    for (const Cell* cell : shifted_backward_) cell->order_ = *order++;
+    for (const Cell* cell : shifted_forward_) cell->order_ = *order++;
+    return true;
+}
+
+std::vector<const Cell*> Sheet::EvaluationOrder(const std::vector<const Cell*>& roots) const {
+    // Обход в глубину по ячейкам, на которые ссылаются формулы, с явным стеком.
+    // Ячейка попадает в порядок после всех своих устаревших предшественников.
+    // Устаревшие предшественники ячейки на вершине стека лежат в конце pending,
+    // с индекса begin; next - следующий из них.
+    struct Frame {
+        const Cell* cell;
+        std::size_t begin;
+        std::size_t next;
+    };
+
+    const std::uint32_t generation = StartGraphVisit().generation;
+    auto visit = [generation](const Cell* cell) {
+        if (!cell->IsStale() || cell->visit_mark_ == generation) return false;
+        cell->visit_mark_ = generation;
+        return true;
+    };
+
+    std::vector<const Cell*> order;
+    std::vector<Frame> stack;
+    std::vector<const Cell*> pending;
+    auto enter = [&](const Cell* cell) {
+        stack.push_back({cell, pending.size(), pending.size()});
+        ForEachPrecedent(*cell, [&pending](const Cell& precedent) {
+            if (precedent.IsStale()) pending.push_back(&precedent);
+        });
+    };
+    for (const Cell* root : roots) {
+        if (!visit(root)) continue;
+        enter(root);
+        while (!stack.empty()) {
+            Frame& frame = stack.back();
+            if (frame.next == pending.size()) {
+                order.push_back(frame.cell);
+                pending.resize(frame.begin);
+                stack.pop_back();
+                continue;
+            }
+            const Cell* precedent = pending[frame.next++];
+            if (visit(precedent)) enter(precedent);
+        }
+    }
+    return order;
+}
+
+void Sheet::EvaluateInRuns(Span<const Cell*> order, bool look_below) const {
+    // Короче MIN_RUN серия не окупается, длиннее MAX_RUN делится на части,
+    // чтобы столбцы значений серии помещались в кэш процессора.
+    constexpr std::size_t MIN_RUN = 8;
+    constexpr std::size_t MAX_RUN = 1024;
+
+    // Шаблоны, которые сериями не вычисляются (см. EvaluateRun).
+    std::unordered_set<const FormulaAST*> rejected;
+    std::vector<const Cell*> run;
+    std::vector<FormulaInterface::Value> values;
+    for (std::size_t index = 0; index < order.size(); ++index) {
+        const Cell* cell = order[index];
+        if (!cell->IsStale()) continue;
+        const FormulaInterface* formula = cell->impl_->GetFormula();
+        const FormulaAST* shared = formula->GetTemplate();
+        if (shared != nullptr && rejected.count(shared) == 0) {
+            CollectRun(order, index, look_below, shared, MAX_RUN, run);
+            if (run.size() >= MIN_RUN) {
+                if (formula->EvaluateRun(*this, run.size(), values)) {
+                    for (std::size_t k = 0; k < run.size(); ++k) {
+                        run[k]->impl_->SetCache(std::move(values[k]));
+                    }
+                    continue;
+                }
+                rejected.insert(shared);
+            }
+        }
+        cell->Evaluate();
+    }
+}
+
+void Sheet::CollectRun(Span<const Cell*> order, std::size_t index, bool look_below, const FormulaAST* shared,
+                       std::size_t max_size, std::vector<const Cell*>& run) const {
+    const Cell& cell = *order[index];
+    run.assign(1, &cell);
+    while (run.size() < max_size) {
+        const Position pos{cell.position_.row + static_cast<int>(run.size()), cell.position_.col};
+        const Cell* next = pos.IsValid() ? FindCell(pos) : nullptr;
+        if (next == nullptr) break;
+        // Без look_below ячейки не из order не читаются: их может вычислять другой поток.
+        const std::size_t at = index + run.size();
+        const bool in_order = at < order.size() && order[at] == next;
+        if (!in_order && !look_below) break;
+        if (!next->IsStale() || next->impl_->GetFormula()->GetTemplate() != shared) break;
+        // Предшественники ячеек, идущих в order подряд за cell, стоят в order
+        // раньше cell и уже вычислены; у остальных это проверяется.
+        if (!in_order) {
+            bool ready = true;
+            ForEachPrecedent(*next, [&ready](const Cell& precedent) {
+                if (precedent.IsStale()) ready = false;
+            });
+            if (!ready) break;
+        }
+        run.push_back(next);
+    }
+}
+
+namespace {
+
+// Точка встречи потоков между уровнями: записи, сделанные до Wait,
+// видны всем потокам после него.
+class Barrier {
+public:
+    explicit Barrier(std::size_t count)
+    : count_(count) {}
+
+    void Wait() {
+        std::unique_lock lock(mutex_);
+        const std::size_t generation = generation_;
+        if (++waiting_ == count_) {
+            waiting_ = 0;
+            ++generation_;
+            all_arrived_.notify_all();
+            return;
+        }
+        all_arrived_.wait(lock, [&] { return generation != generation_; });
+    }
+
+    // Уменьшает число участников, например если поток не удалось запустить.
+    void Leave() {
+        std::lock_guard guard(mutex_);
+        if (--count_ > 0 && waiting_ == count_) {
+            waiting_ = 0;
+            ++generation_;
+            all_arrived_.notify_all();
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable all_arrived_;
+    std::size_t count_;
+    std::size_t waiting_ = 0;
+    std::size_t generation_ = 0;
+};
+
+}  // namespace
+
+void Sheet::EvaluateParallel(const std::vector<const Cell*>& order, unsigned num_threads) const {
+    // Уровни, в которых меньше ячеек, чем PARALLEL_LEVEL, идут подряд одним
+    // этапом в одном потоке: иначе на длинной цепочке потоки только ждали бы друг друга.
+    constexpr std::size_t PARALLEL_LEVEL = 256;
+    // Ячеек, которые поток забирает из уровня за один раз.
+    constexpr std::size_t CHUNK = 32;
+
+    if (order.size() < PARALLEL_LEVEL) {
+        EvaluateInRuns(order, true);
+        return;
+    }
+
+    // Все устаревшие предшественники ячейки стоят в order раньше неё,
+    // поэтому уровни считаются одним проходом.
+    std::vector<std::size_t> level_start;
+    for (const Cell* cell : order) {
+        std::uint32_t level = 0;
+        ForEachPrecedent(*cell, [&level](const Cell& precedent) {
+            if (precedent.IsStale()) level = std::max(level, precedent.scratch_ + 1);
+        });
+        cell->scratch_ = level;
+        if (level + 1 >= level_start.size()) level_start.resize(level + 2, 0);
+        ++level_start[level + 1];
+    }
+    for (std::size_t level = 1; level < level_start.size(); ++level) {
+        level_start[level] += level_start[level - 1];
+    }
+    std::vector<const Cell*> by_level(order.size());
+    {
+        std::vector<std::size_t> next(level_start.begin(), level_start.end() - 1);
+        for (const Cell* cell : order) {
+            by_level[next[cell->scratch_]++] = cell;
+        }
+    }
+    // Ячейки уровня не зависят друг от друга, поэтому их можно переставить:
+    // по столбцам формулы одного шаблона оказываются рядом и вычисляются
+    // сериями внутри порции потока.
+    for (std::size_t level = 0; level + 1 < level_start.size(); ++level) {
+        std::sort(by_level.begin() + level_start[level], by_level.begin() + level_start[level + 1],
+                  [](const Cell* lhs, const Cell* rhs) {
+                      const Position l = lhs->GetPosition();
+                      const Position r = rhs->GetPosition();
+                      return l.col != r.col ? l.col < r.col : l.row < r.row;
+                  });
+    }
+
+    struct Stage {
+        std::size_t begin;
+        std::size_t end;
+        bool parallel;
+    };
+    std::vector<Stage> stages;
+    for (std::size_t level = 0; level + 1 < level_start.size(); ++level) {
+        const std::size_t begin = level_start[level];
+        const std::size_t end = level_start[level + 1];
+        const bool parallel = end - begin >= PARALLEL_LEVEL;
+        if (!parallel && !stages.empty() && !stages.back().parallel) {
+            stages.back().end = end;
+        } else {
+            stages.push_back({begin, end, parallel});
+        }
+    }
+
+    const std::size_t thread_count = std::min<std::size_t>(num_threads, order.size() / CHUNK + 1);
+    std::unique_ptr<std::atomic<std::size_t>[]> cursors(new std::atomic<std::size_t>[stages.size()]);
+    for (std::size_t i = 0; i < stages.size(); ++i) {
+        cursors[i].store(stages[i].begin, std::memory_order_relaxed);
+    }
+    Barrier barrier(thread_count);
+    std::atomic<bool> failed = false;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto work = [&](std::size_t thread_index) {
+        for (std::size_t i = 0; i < stages.size(); ++i) {
+            const Stage& stage = stages[i];
+            if (!failed.load(std::memory_order_relaxed) && (stage.parallel || thread_index == 0)) {
+                try {
+                    // Свободный поток забирает очередную порцию уровня, так что
+                    // медленные формулы не задерживают остальные потоки.
+                    const std::size_t step = stage.parallel ? CHUNK : stage.end - stage.begin;
+                    for (std::size_t begin = cursors[i].fetch_add(step, std::memory_order_relaxed);
+                         begin < stage.end;
+                         begin = cursors[i].fetch_add(step, std::memory_order_relaxed)) {
+                        const std::size_t end = std::min(begin + step, stage.end);
+                        EvaluateInRuns({by_level.data() + begin, end - begin}, false);
+                    }
+                } catch (...) {
+                    std::lock_guard guard(error_mutex);
+                    if (!error) error = std::current_exception();
+                    failed = true;
+                }
+            }
+            if (i + 1 < stages.size()) barrier.Wait();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (std::size_t thread_index = 1; thread_index < thread_count; ++thread_index) {
+        try {
+            threads.emplace_back(work, thread_index);
+        } catch (const std::system_error&) {
+            // Не запущенные потоки не участвуют; их работу заберут остальные.
+            for (; thread_index < thread_count; ++thread_index) {
+                barrier.Leave();
+            }
+        }
+    }
+    work(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+Size Sheet::GetPrintableSize() const {
+    const Size cells = data_.Extent();
+    const Size numbers = numbers_.Extent();
+    return {std::max(cells.rows, numbers.rows), std::max(cells.cols, numbers.cols)};
+}
+
+
+// Накапливает вывод во внутреннем буфере и пишет в поток крупными блоками.
+// Числа форматируются через to_chars так же, как operator<< форматирует их
+// при настройках потока по умолчанию; при других настройках печать числа
+// отдаётся самому потоку.
+class Sheet::PrintBuffer {
+public:
+    explicit PrintBuffer(std::ostream& output)
+    : output_(output),
+      fast_numbers_((output.flags() & (std::ios_base::floatfield | std::ios_base::showpoint
+                                       | std::ios_base::showpos | std::ios_base::uppercase)) == 0
+                    && output.width() == 0
+                    && output.getloc() == std::locale::classic()),
+      precision_(static_cast<int>(output.precision())) {}
+
+    PrintBuffer(const PrintBuffer&) = delete;
+    PrintBuffer& operator=(const PrintBuffer&) = delete;
+
+    ~PrintBuffer() {
+        Flush();
+    }
+
+    void Append(std::string_view text) {
+        if (text.size() > CAPACITY - size_) {
+            Flush();
+            if (text.size() > CAPACITY) {
+                output_.write(text.data(), static_cast<std::streamsize>(text.size()));
+                return;
+            }
+        }
+        std::copy(text.begin(), text.end(), buffer_.data() + size_);
+        size_ += text.size();
+    }
+
+    void Append(char ch, std::size_t count) {
+        while (count > 0) {
+            if (size_ == CAPACITY) {
+                Flush();
+            }
+            std::size_t chunk = std::min(count, CAPACITY - size_);
+            std::fill_n(buffer_.data() + size_, chunk, ch);
+            size_ += chunk;
+            count -= chunk;
+        }
+    }
+
+    void Append(double value) {
+        if (!fast_numbers_) {
+            Flush();
+            output_ << value;
+            return;
+        }
+        constexpr std::size_t MAX_NUMBER_LENGTH = 64;
+        if (CAPACITY - size_ < MAX_NUMBER_LENGTH) {
+            Flush();
+        }
+        char* begin = buffer_.data() + size_;
+        auto result = std::to_chars(begin, begin + MAX_NUMBER_LENGTH, value, std::chars_format::general, precision_);
+        if (result.ec != std::errc{}) {
+            Flush();
+            output_ << value;
+            return;
+        }
+        size_ += result.ptr - begin;
+    }
+
+    void Flush() {
+        if (size_ > 0) {
+            output_.write(buffer_.data(), static_cast<std::streamsize>(size_));
+            size_ = 0;
+        }
+    }
+
+private:
+    static constexpr std::size_t CAPACITY = 1 << 16;
+
+    std::ostream& output_;
+    const bool fast_numbers_;
+    const int precision_;
+    std::array<char, CAPACITY> buffer_;
+    std::size_t size_ = 0;
+};
 
 void Sheet::Print(std::ostream& output, TypePrint type_print) const {
-    if (data_.empty()) {
-           output << ""s;
-           return;
-       }
-
-       Size printable_area = GetPrintableSize();
-       for (int row = 0; row < printable_area.rows; ++row)
-       {
-           for (int col = 0; col < printable_area.cols; ++col)
-           {
-               const CellInterface *cell = GetCell(
-               { row, col });
-               if (cell)
-               {
-                   if(type_print == TypePrint::VALUE) {
-                       PrintValue(cell, output);
-                   }
-                   else if (type_print == TypePrint::TEXT){
-                       output << cell->GetText();
-                   }
-                   else{
-                       throw std::runtime_error("Выбран не верный тип значений для вывода на экран.");
-                   }
-               }
-               else
-               {
-                   output << "";
-               }
-               if (col < printable_area.cols - 1)
-               {
-                   output << '\t';
-               }
-           }
-           output << '\n';
-       }
+    if (data_.Empty() && numbers_.Empty()) {
+        return;
+    }
+
+    // Обходятся только занятые ячейки в порядке строк, пропуски между ними
+    // заполняются табуляциями и переводами строк. Числа без объектов ячеек
+    // вливаются в обход: их текст и значение совпадают с записью числа.
+    const Size printable_area = GetPrintableSize();
+    auto buffer = std::make_unique<PrintBuffer>(output);
+    int row = 0;
+    int col = 0;
+    auto finish_row = [&] {
+        buffer->Append('\t', printable_area.cols - 1 - col);
+        buffer->Append('\n', 1);
+        ++row;
+        col = 0;
+    };
+
+    auto move_to = [&](Position pos) {
+        while (row < pos.row) {
+            finish_row();
+        }
+        buffer->Append('\t', pos.col - col);
+        col = pos.col;
+    };
+    NumericColumns::RowCursor numbers(numbers_);
+    auto print_numbers_before = [&](Position pos) {
+        for (; numbers.Valid() && numbers.Pos() < pos; numbers.Next()) {
+            move_to(numbers.Pos());
+            buffer->Append(NumberText(numbers.Value()).View());
+        }
+    };
+
+    data_.ForEach([&](Position pos, const std::unique_ptr<Cell>& cell) {
+        print_numbers_before(pos);
+        move_to(pos);
+        if (type_print == TypePrint::VALUE) {
+            PrintValue(cell.get(), *buffer);
+        } else if (type_print == TypePrint::TEXT) {
+            buffer->Append(cell->GetText());
+        } else {
+            throw std::runtime_error("Выбран не верный тип значений для вывода на экран.");
+        }
+    });
+    print_numbers_before({Position::MAX_ROWS, 0});
+    while (row < printable_area.rows) {
+        finish_row();
+    }
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
@@ -105,16 +987,14 @@ void Sheet::PrintTexts(std::ostream& output) const {
     Print(output, TypePrint::TEXT);
 }
 
-void Sheet::PrintValue(const CellInterface* cell, std::ostream& output) const{
-    CellInterface::Value val = cell->GetValue();
-    if (std::holds_alternative<double>(val)){
-        output << std::get<double>(val);
-    }
-    else if(std::holds_alternative<std::string>(val)){
-        output << std::get<std::string>(val);
-    }
-    else if(std::holds_alternative<FormulaError>(val)){
-        output << std::get<FormulaError>(val);
+void Sheet::PrintValue(const CellInterface* cell, PrintBuffer& buffer) const {
+    CellInterface::ValueView val = cell->GetValueView();
+    if (std::holds_alternative<double>(val)) {
+        buffer.Append(std::get<double>(val));
+    } else if (std::holds_alternative<std::string_view>(val)) {
+        buffer.Append(std::get<std::string_view>(val));
+    } else if (std::holds_alternative<FormulaError>(val)) {
+        buffer.Append(std::get<FormulaError>(val).ToString());
     }
 }
 
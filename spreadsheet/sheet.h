@@ -2,8 +2,14 @@
 
 #include "cell.h"
 #include "common.h"
+#include "numeric_columns.h"
+#include "range_index.h"
+#include "snapshot.h"
+#include "tiled_grid.h"
 #include <functional>
+#include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 
 
 class Sheet : public SheetInterface {
@@ -17,14 +23,252 @@ public:
     Size GetPrintableSize() const override;
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+    void BeginBatch() override;
+    void CommitBatch() override;
+    std::optional<double> GetStoredNumber(Position pos) const override;
+    void GetRangeCells(Range range, std::vector<double>& numbers,
+                       std::vector<const CellInterface*>& cells) const override;
+    void GetColumnCells(Position top, std::size_t count, double* numbers,
+                        const CellInterface** cells) const override;
+
+    // Записывает ячейки одним пакетом, как SetCell между BeginBatch и CommitBatch.
+    // Формулы разбираются заранее в num_threads потоках; если хоть одна из них
+    // некорректна, лист не меняется.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells, unsigned num_threads = 1);
+
+    // Двоичный снимок листа: тексты ячеек, скомпилированные формулы, связи
+    // и вычисленные значения. Формат описан в snapshot.cpp.
+    void SaveSnapshot(std::ostream& output) const;
+    // Загружает снимок, отображая файл в память. Формулы не разбираются:
+    // их программы декодируются при первом пересчёте. При RECALCULATE
+    // сохранённые значения отбрасываются и все формулы вычисляются заново.
+    // Бросает SnapshotError, если файл не снимок или версия не совпадает.
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::string& path,
+                                               SnapshotValues values = SnapshotValues::RESTORE);
+
+    // Ячейка по позиции без проверки позиции, nullptr для пустой
+    // и для числа, хранящегося без объекта ячейки.
+    Cell* FindCell(Position pos) const;
+    // Ячейка, на которую формула ссылается напрямую и которой нужны обратные
+    // связи: число из numbers_ переносится в объект ячейки, в пустой позиции
+    // создаётся пустая ячейка.
+    Cell& ReferencedCell(Position pos);
+
+    // Связи графа зависимостей складываются из ссылок на отдельные ячейки
+    // и ссылок на диапазоны. Ссылки на диапазоны хранятся одной записью
+    // в индексе диапазонов: ячейки внутри диапазона не создаются и обратных
+    // связей не получают.
+    // Вызывает func(Cell&) для ячеек, от которых формула cell зависит напрямую.
+    // Ячейка из нескольких диапазонов формулы встречается несколько раз.
+    template <typename Func>
+    void ForEachPrecedent(const Cell& cell, Func func) const;
+    // Вызывает func(Cell&) для ячеек, формулы которых напрямую зависят от cell.
+    template <typename Func>
+    void ForEachDependent(const Cell& cell, Func func) const;
+    // Вызывает func(Cell&) для существующих ячеек внутри range.
+    template <typename Func>
+    void ForEachCellInRange(Range range, Func func) const;
+    bool HasDependents(const Cell& cell) const;
+    // Заносит диапазоны формулы ячейки в индекс диапазонов и убирает их оттуда.
+    void AddRangeDependencies(const Cell& cell);
+    void RemoveRangeDependencies(const Cell& cell);
+
+    // Вычисляет все формулы, значения которых устарели, каждую ровно один раз
+    // и в порядке зависимостей, без рекурсии. При num_threads > 1 независимые
+    // друг от друга формулы вычисляются параллельно; результат тот же, что и
+    // при вычислении в одном потоке.
+    void Recalculate(unsigned num_threads = 1);
+    // Вычисляет устаревшую ячейку вместе со всеми устаревшими ячейками, от которых она зависит.
+    void Compute(const Cell& cell);
+    // Ставит ячейку в очередь устаревших.
+    void MarkDirty(Cell& cell);
+    // Длина очереди устаревших ячеек.
+    std::size_t DirtyCount() const;
+    // Пул для содержимого ячеек листа (CellImpl).
+    SlabPool& ImplPool();
+
+    // Обход графа зависимостей: ячейки, у которых visit_mark_ равен generation,
+    // уже посещены. Стек общий для всех обходов листа и сохраняет выделенную память,
+    // поэтому обходы не должны вкладываться друг в друга.
+    struct GraphVisit {
+        std::uint32_t generation;
+        std::vector<const Cell*>& stack;
+    };
+    GraphVisit StartGraphVisit() const;
+
+    // Лист поддерживает топологический порядок ячеек: у каждой формулы order_
+    // ячеек, на которые она ссылается, меньше её собственного. Порядок
+    // обновляется инкрементально по алгоритму Пирса-Келли.
+    // Ставит ячейку в начало порядка. Допустимо для ячейки без предшественников.
+    void PlaceFirst(Cell& cell);
+    // Ставит ячейку в конец порядка. Допустимо для ячейки без зависимых.
+    void PlaceLast(Cell& cell);
+    // Восстанавливает порядок для новой связи precedent -> dependent.
+    // Возвращает false, если связь замкнула бы цикл; порядок при этом остаётся верным.
+    bool KeepOrdered(const Cell& precedent, const Cell& dependent);
 
 private:
+    static constexpr std::size_t MIN_DIRTY_LIMIT = 1024;
+
     enum class TypePrint{
        TEXT, VALUE
     };
 
-    void PrintValue(const CellInterface* cell, std::ostream& output) const;
+    class PrintBuffer;
+
+    // Число из numbers_, каким его видит GetCell: текст ячейки с записью
+    // NumberText, без объекта ячейки в листе. У позиции одно представление,
+    // при перезаписи числа оно меняется на месте.
+    class NumberView : public CellInterface {
+    public:
+        explicit NumberView(double number)
+        : number_(number)
+        , text_(number) {}
+
+        void Set(double number) {
+            number_ = number;
+            text_ = NumberText(number);
+        }
+
+        Value GetValue() const override {
+            return std::string(text_.View());
+        }
+        ValueView GetValueView() const override {
+            return text_.View();
+        }
+        std::optional<double> GetTextNumber() const override {
+            return number_;
+        }
+        std::string_view GetText() const override {
+            return text_.View();
+        }
+        std::vector<Position> GetReferencedCells() const override {
+            return {};
+        }
+
+    private:
+        double number_;
+        NumberText text_;
+    };
+
+    // Отложенная правка пакета. Формула разбирается сразу, чтобы ошибка
+    // в ней была видна в SetCell.
+    struct BatchEdit {
+        Position pos;
+        std::string text;
+        std::unique_ptr<CellImpl> impl;
+        Cell::PositionsSet precedents;
+        bool clear = false;
+        // Значение, если text - числовая константа (см. ConstantNumber).
+        std::optional<double> number;
+    };
+
+    BatchEdit MakeBatchEdit(Position pos, std::string text, bool clear);
+    // Ничего ли не изменит запись text в ячейку pos (Cell::HasText). Канонические
+    // записи формул не сравниваются: в них константы округлены, и разные
+    // формулы могут совпасть.
+    bool HasText(Position pos, std::string_view text) const;
+    // Новая пустая ячейка в пуле листа.
+    std::unique_ptr<Cell> NewCell(Position pos);
+    // Число, если текст совпадает с его записью NumberText: такую ячейку
+    // можно хранить в numbers_ и восстанавливать текст по значению.
+    static std::optional<double> ConstantNumber(std::string_view text);
+    // Переносит число из numbers_ в обычную ячейку и возвращает её,
+    // nullptr, если числа в позиции нет. Представление числа не удаляется.
+    Cell* CellFromNumber(Position pos);
+    // Представление числа из numbers_ для GetCell.
+    NumberView* ViewNumber(Position pos, double number) const;
+    // Записывает число в numbers_ и в его представление, если оно есть.
+    void SetNumber(Position pos, double number);
+    // Удаляет число из numbers_ вместе с представлением; false, если числа нет.
+    bool EraseNumber(Position pos);
+    // Удаляет представление позиции, в которой больше нет числа.
+    void DropNumberView(Position pos);
+    // Сбрасывает значения формул, диапазоны которых содержат pos.
+    void InvalidateRangeDependents(Position pos);
+    void AddBatchEdit(BatchEdit edit);
+    // Убирает из dirty_ ячейки, которые уже вычислены или удалены.
+    void CompactDirty();
+
+    void PrintValue(const CellInterface* cell, PrintBuffer& buffer) const;
     void Print(std::ostream& output, TypePrint type_print) const;
+    // Устаревшие ячейки, от которых зависят roots, и сами roots
+    // в порядке, в котором их можно вычислить.
+    std::vector<const Cell*> EvaluationOrder(const std::vector<const Cell*>& roots) const;
+    // Вычисляет ячейки order по очереди. Формулы одного шаблона, идущие в order
+    // подряд в ячейках друг под другом, вычисляются одной серией
+    // (FormulaInterface::EvaluateRun). При look_below в серию берутся и другие
+    // устаревшие формулы шаблона под ячейкой, все предшественники которых уже
+    // вычислены; такие ячейки при своей очереди в order пропускаются. Без
+    // look_below меняются только ячейки order, поэтому непересекающиеся части
+    // порядка можно вычислять в разных потоках.
+    void EvaluateInRuns(Span<const Cell*> order, bool look_below) const;
+    // Собирает в run ячейку order[index] и формулы шаблона shared под ней
+    // (см. EvaluateInRuns), всего не больше max_size ячеек.
+    void CollectRun(Span<const Cell*> order, std::size_t index, bool look_below, const FormulaAST* shared,
+                    std::size_t max_size, std::vector<const Cell*>& run) const;
+    // Разбивает order на уровни зависимостей и вычисляет каждый уровень в num_threads потоках.
+    void EvaluateParallel(const std::vector<const Cell*>& order, unsigned num_threads) const;
 
-    std::unordered_map<Position, std::unique_ptr<Cell>, std::hash<Position>> data_;
+    // Пулы объявлены первыми: ячейки и их содержимое в data_ и batch_
+    // должны быть удалены раньше пулов.
+    SlabPool cell_pool_{sizeof(Cell), alignof(Cell)};
+    SlabPool impl_pool_{CELL_IMPL_SIZE, CELL_IMPL_ALIGN};
+    TiledGrid<std::unique_ptr<Cell>> data_;
+    // Числовые константы без объектов ячеек; позиция занята либо здесь,
+    // либо в data_. Ячейке, на которую формула ссылается напрямую, нужны
+    // обратные связи, поэтому такие числа переносятся в data_ (ReferencedCell).
+    NumericColumns numbers_;
+    // Представления чисел, выданные GetCell. Живут, пока в позиции число:
+    // при перезаписи числа меняются на месте, при удалении числа или
+    // переносе его в data_ удаляются.
+    mutable std::unordered_map<Position, std::unique_ptr<NumberView>, std::hash<Position>> number_views_;
+    mutable std::mutex number_views_mutex_;
+    RangeIndex range_index_;
+    // Позиции ячеек, значения которых устарели после изменений. Если значения
+    // читаются без Recalculate, очередь чистится от уже вычисленных ячеек,
+    // когда дорастает до dirty_limit_.
+    std::vector<Position> dirty_;
+    std::size_t dirty_limit_ = MIN_DIRTY_LIMIT;
+    mutable std::uint32_t visit_generation_ = 0;
+    mutable std::vector<const Cell*> visit_stack_;
+    std::int64_t first_order_ = 0;
+    std::int64_t last_order_ = 0;
+    // Буферы KeepOrdered, сохраняют память между вызовами.
+    std::vector<const Cell*> shifted_forward_;
+    std::vector<const Cell*> shifted_backward_;
+    std::vector<std::int64_t> shifted_orders_;
+    int batch_depth_ = 0;
+    // Правки пакета в порядке первого изменения позиции; повторная правка заменяет прежнюю.
+    std::vector<BatchEdit> batch_;
+    std::unordered_map<Position, std::size_t, std::hash<Position>> batch_index_;
 };
+
+template <typename Func>
+void Sheet::ForEachPrecedent(const Cell& cell, Func func) const {
+    for (Position pos : cell.cells_referring_by_me_) {
+        if (Cell* precedent = FindCell(pos)) func(*precedent);
+    }
+    for (const Range& range : cell.GetPrecedentRanges()) {
+        ForEachCellInRange(range, [&func](Cell& precedent) {
+            func(precedent);
+        });
+    }
+}
+
+template <typename Func>
+void Sheet::ForEachDependent(const Cell& cell, Func func) const {
+    for (Position pos : cell.cells_referring_me_) {
+        if (Cell* dependent = FindCell(pos)) func(*dependent);
+    }
+    range_index_.ForEachDependent(cell.position_, [this, &func](Position pos) {
+        if (Cell* dependent = FindCell(pos)) func(*dependent);
+    });
+}
+
+template <typename Func>
+void Sheet::ForEachCellInRange(Range range, Func func) const {
+    data_.ForEachInRange(range, [&func](Position, const std::unique_ptr<Cell>& cell) {
+        func(*cell);
+    });
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+
+// Пул блоков одного размера для объектов листа. Память берётся плитами
+// по SLAB_BYTES, выровненными по своему размеру, поэтому плита блока
+// находится по его адресу: Free не нужна ссылка на пул, и объекты
+// удаляются обычным delete через operator delete своего класса.
+// Освобождённый блок идёт в список свободных своей плиты, опустевшая
+// плита возвращается в кучу (одна остаётся про запас). Выделение
+// и освобождение потокобезопасны.
+class SlabPool {
+public:
+    static constexpr std::size_t SLAB_BYTES = std::size_t{1} << 16;
+
+    SlabPool(std::size_t block_size, std::size_t alignment)
+        : block_size_(RoundUp(std::max(block_size, sizeof(void*)), alignment))
+        , offset_(RoundUp(sizeof(Slab), alignment))
+        , capacity_((SLAB_BYTES - offset_) / block_size_) {
+    }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    // К моменту разрушения пула все его блоки должны быть освобождены.
+    ~SlabPool() {
+        assert(slab_count_ == (spare_ != nullptr ? 1 : 0));
+        if (spare_ != nullptr) ReleaseSlab(spare_);
+    }
+
+    void* Allocate() {
+        std::lock_guard guard(mutex_);
+        Slab* slab = partial_;
+        if (slab == nullptr) {
+            slab = spare_ != nullptr ? std::exchange(spare_, nullptr) : NewSlab();
+            Link(slab);
+        }
+        void* block = slab->free;
+        if (block != nullptr) {
+            slab->free = *static_cast<void**>(block);
+        } else {
+            block = reinterpret_cast<char*>(slab) + offset_ + slab->fresh++ * block_size_;
+        }
+        if (++slab->used == capacity_) Unlink(slab);
+        return block;
+    }
+
+    static void Free(void* block) {
+        Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<std::uintptr_t>(block) & ~(SLAB_BYTES - 1));
+        SlabPool& pool = *slab->pool;
+        std::lock_guard guard(pool.mutex_);
+        *static_cast<void**>(block) = slab->free;
+        slab->free = block;
+        if (slab->used-- == pool.capacity_) pool.Link(slab);
+        if (slab->used == 0) {
+            pool.Unlink(slab);
+            if (pool.spare_ == nullptr) {
+                slab->free = nullptr;
+                slab->fresh = 0;
+                pool.spare_ = slab;
+            } else {
+                pool.ReleaseSlab(slab);
+            }
+        }
+    }
+
+    // Размер блока с учётом выравнивания.
+    std::size_t BlockSize() const {
+        return block_size_;
+    }
+
+    // Число плит, взятых из кучи, вместе с запасной.
+    std::size_t SlabCount() const {
+        std::lock_guard guard(mutex_);
+        return slab_count_;
+    }
+
+private:
+    struct Slab {
+        SlabPool* pool;
+        // Соседи в списке плит со свободными блоками.
+        Slab* prev;
+        Slab* next;
+        // Список освобождённых блоков; блоки от fresh до конца плиты ещё не выдавались.
+        void* free;
+        std::size_t fresh;
+        std::size_t used;
+    };
+
+    static std::size_t RoundUp(std::size_t size, std::size_t alignment) {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    Slab* NewSlab() {
+        void* memory = ::operator new(SLAB_BYTES, std::align_val_t{SLAB_BYTES});
+        Slab* slab = new (memory) Slab{this, nullptr, nullptr, nullptr, 0, 0};
+        ++slab_count_;
+        return slab;
+    }
+
+    void ReleaseSlab(Slab* slab) {
+        --slab_count_;
+        ::operator delete(slab, SLAB_BYTES, std::align_val_t{SLAB_BYTES});
+    }
+
+    void Link(Slab* slab) {
+        slab->prev = nullptr;
+        slab->next = partial_;
+        if (partial_ != nullptr) partial_->prev = slab;
+        partial_ = slab;
+    }
+
+    void Unlink(Slab* slab) {
+        if (slab->prev != nullptr) {
+            slab->prev->next = slab->next;
+        } else {
+            partial_ = slab->next;
+        }
+        if (slab->next != nullptr) slab->next->prev = slab->prev;
+    }
+
+    const std::size_t block_size_;
+    // Смещение первого блока от начала плиты и число блоков в плите.
+    const std::size_t offset_;
+    const std::size_t capacity_;
+    mutable std::mutex mutex_;
+    // Плиты, в которых есть свободные блоки.
+    Slab* partial_ = nullptr;
+    Slab* spare_ = nullptr;
+    std::size_t slab_count_ = 0;
+};
+
+// Основа классов, объекты которых создаются в пуле: new (pool) T(...).
+// Обычный new для них не компилируется, delete возвращает блок в пул.
+class SlabAllocated {
+public:
+    static void* operator new(std::size_t size, SlabPool& pool) {
+        assert(size <= pool.BlockSize());
+        return pool.Allocate();
+    }
+
+    // Вызывается, если конструктор объекта бросил исключение.
+    static void operator delete(void* block, SlabPool&) {
+        SlabPool::Free(block);
+    }
+
+    static void operator delete(void* block) {
+        SlabPool::Free(block);
+    }
+};
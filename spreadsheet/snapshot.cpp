@@ -0,0 +1,359 @@
+#include "snapshot.h"
+
+#include "cell.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNAPSHOT_USE_MMAP 1
+#endif
+
+using namespace std::literals;
+
+// Формат снимка. Все числа в порядке байтов машины, которая его записала;
+// BYTE_ORDER_MARK в заголовке отсекает снимки с другим порядком.
+//
+//   Заголовок, HEADER_SIZE байт:
+//     magic[8], version u32, byte order mark u32,
+//     cell count u64, cells offset u64, refs offset u64, refs count u64,
+//     blob offset u64, blob size u64
+//   Записи ячеек, RECORD_SIZE байт каждая, в топологическом порядке,
+//   первыми - числа без объектов ячеек (kind NUMBER: значение в value,
+//   текста и ссылок нет, текст восстанавливается по числу):
+//     row i32, col i32, value f64,
+//     text offset u64, program offset u64, text size u32, program size u32,
+//     refs begin u32, refs count u32,
+//     kind u8, value kind u8, error category u8, 1 байт выравнивания,
+//     ranges count u32
+//   Ссылки формул: row i32, col i32 каждая. За ссылками формулы на отдельные
+//   ячейки идут её диапазоны, по две ссылки на диапазон: first и last.
+//   Blob: тексты ячеек (для формул - выражение без '=') и программы формул.
+//
+// Ячейки занимают фиксированные записи, поэтому загрузка только проходит
+// по ним, не разбирая текстов; программы формул остаются в отображённом
+// файле до первого вычисления.
+namespace {
+
+constexpr char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+constexpr std::size_t HEADER_SIZE = 64;
+constexpr std::size_t RECORD_SIZE = 56;
+constexpr std::size_t REF_SIZE = 8;
+
+enum class CellKind : std::uint8_t {
+    EMPTY,
+    TEXT,
+    FORMULA,
+    NUMBER,
+};
+
+enum class ValueKind : std::uint8_t {
+    NONE,
+    NUMBER,
+    ERROR,
+};
+
+template <typename T>
+void Put(std::string& out, T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+}
+
+template <typename T>
+T Get(const char* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+// Файл снимка, отображённый в память, либо прочитанный целиком там,
+// где отображения нет.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef SNAPSHOT_USE_MMAP
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw SnapshotError("Не удалось открыть снимок "s + path);
+        struct stat info {};
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            size_ = static_cast<std::size_t>(info.st_size);
+            void* address = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) data_ = static_cast<const char*>(address);
+        }
+        ::close(fd);
+        if (data_ == nullptr) throw SnapshotError("Не удалось отобразить снимок "s + path);
+#else
+        std::ifstream input(path, std::ios::binary);
+        if (!input) throw SnapshotError("Не удалось открыть снимок "s + path);
+        contents_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        data_ = contents_.data();
+        size_ = contents_.size();
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifdef SNAPSHOT_USE_MMAP
+        ::munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    std::string_view Data() const {
+        return {data_, size_};
+    }
+
+private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+#ifndef SNAPSHOT_USE_MMAP
+    std::string contents_;
+#endif
+};
+
+}  // namespace
+
+void Sheet::SaveSnapshot(std::ostream& output) const {
+    std::vector<const Cell*> cells;
+    data_.ForEach([&cells](Position, const std::unique_ptr<Cell>& cell) {
+        cells.push_back(cell.get());
+    });
+    std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ < rhs->order_;
+    });
+
+    std::string records;
+    std::string refs;
+    std::string blob;
+    std::size_t refs_count = 0;
+    records.reserve((numbers_.Count() + cells.size()) * RECORD_SIZE);
+    numbers_.ForEach([&records](Position pos, double number) {
+        Put<std::int32_t>(records, pos.row);
+        Put<std::int32_t>(records, pos.col);
+        Put<double>(records, number);
+        records.append(32, '\0');
+        Put(records, CellKind::NUMBER);
+        Put(records, ValueKind::NUMBER);
+        records.append(6, '\0');
+    });
+    for (const Cell* cell : cells) {
+        const FormulaInterface* formula = cell->impl_->GetFormula();
+        CellKind kind = CellKind::EMPTY;
+        ValueKind value_kind = ValueKind::NONE;
+        double number = 0;
+        std::uint8_t category = 0;
+        const std::size_t text_offset = blob.size();
+        std::size_t program_offset = 0;
+        std::size_t program_size = 0;
+        ShiftedSpan<Position> precedents;
+        ShiftedSpan<Range> ranges;
+
+        if (formula != nullptr) {
+            kind = CellKind::FORMULA;
+            blob += formula->GetExpression();
+            program_offset = blob.size();
+            formula->SerializeProgram(blob);
+            program_size = blob.size() - program_offset;
+            precedents = formula->GetReferencedCells();
+            ranges = formula->GetReferencedRanges();
+            if (!cell->IsStale()) {
+                const CellInterface::ValueView value = cell->impl_->GetValueView(*this);
+                if (const double* result = std::get_if<double>(&value)) {
+                    value_kind = ValueKind::NUMBER;
+                    number = *result;
+                } else {
+                    value_kind = ValueKind::ERROR;
+                    category = static_cast<std::uint8_t>(std::get<FormulaError>(value).GetCategory());
+                }
+            }
+        } else {
+            blob += cell->GetText();
+            if (blob.size() > text_offset) kind = CellKind::TEXT;
+        }
+        const std::size_t text_size = (kind == CellKind::FORMULA ? program_offset : blob.size()) - text_offset;
+
+        Put<std::int32_t>(records, cell->position_.row);
+        Put<std::int32_t>(records, cell->position_.col);
+        Put<double>(records, number);
+        Put<std::uint64_t>(records, text_offset);
+        Put<std::uint64_t>(records, program_offset);
+        Put<std::uint32_t>(records, static_cast<std::uint32_t>(text_size));
+        Put<std::uint32_t>(records, static_cast<std::uint32_t>(program_size));
+        Put<std::uint32_t>(records, static_cast<std::uint32_t>(refs_count));
+        Put<std::uint32_t>(records, static_cast<std::uint32_t>(precedents.size()));
+        Put(records, kind);
+        Put(records, value_kind);
+        Put(records, category);
+        records.append(1, '\0');
+        Put<std::uint32_t>(records, static_cast<std::uint32_t>(ranges.size()));
+
+        for (Position pos : precedents) {
+            Put<std::int32_t>(refs, pos.row);
+            Put<std::int32_t>(refs, pos.col);
+        }
+        for (const Range& range : ranges) {
+            for (Position pos : {range.first, range.last}) {
+                Put<std::int32_t>(refs, pos.row);
+                Put<std::int32_t>(refs, pos.col);
+            }
+        }
+        refs_count += precedents.size() + 2 * ranges.size();
+    }
+
+    std::string header(MAGIC, sizeof(MAGIC));
+    Put(header, SNAPSHOT_VERSION);
+    Put(header, BYTE_ORDER_MARK);
+    Put<std::uint64_t>(header, numbers_.Count() + cells.size());
+    Put<std::uint64_t>(header, HEADER_SIZE);
+    Put<std::uint64_t>(header, HEADER_SIZE + records.size());
+    Put<std::uint64_t>(header, refs_count);
+    Put<std::uint64_t>(header, HEADER_SIZE + records.size() + refs.size());
+    Put<std::uint64_t>(header, blob.size());
+    header.resize(HEADER_SIZE, '\0');
+
+    output.write(header.data(), static_cast<std::streamsize>(header.size()));
+    output.write(records.data(), static_cast<std::streamsize>(records.size()));
+    output.write(refs.data(), static_cast<std::streamsize>(refs.size()));
+    output.write(blob.data(), static_cast<std::streamsize>(blob.size()));
+    if (!output) throw SnapshotError("Не удалось записать снимок"s);
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::string& path, SnapshotValues values) {
+    auto file = std::make_shared<const MappedFile>(path);
+    const std::string_view data = file->Data();
+    if (data.size() < HEADER_SIZE || data.substr(0, sizeof(MAGIC)) != std::string_view(MAGIC, sizeof(MAGIC))) {
+        throw SnapshotError("Файл не является снимком листа: "s + path);
+    }
+    const auto version = Get<std::uint32_t>(data.data() + 8);
+    if (Get<std::uint32_t>(data.data() + 12) != BYTE_ORDER_MARK || version != SNAPSHOT_VERSION) {
+        throw SnapshotError("Неподдерживаемая версия снимка "s + std::to_string(version) + ": "s + path);
+    }
+    const auto cell_count = Get<std::uint64_t>(data.data() + 16);
+    const auto cells_offset = Get<std::uint64_t>(data.data() + 24);
+    const auto refs_offset = Get<std::uint64_t>(data.data() + 32);
+    const auto refs_count = Get<std::uint64_t>(data.data() + 40);
+    const auto blob_offset = Get<std::uint64_t>(data.data() + 48);
+    const auto blob_size = Get<std::uint64_t>(data.data() + 56);
+    auto fits = [](std::uint64_t offset, std::uint64_t count, std::uint64_t size, std::uint64_t limit) {
+        return offset <= limit && count <= (limit - offset) / size;
+    };
+    if (!fits(cells_offset, cell_count, RECORD_SIZE, data.size()) || !fits(refs_offset, refs_count, REF_SIZE, data.size())
+        || !fits(blob_offset, blob_size, 1, data.size())) {
+        throw SnapshotError("Снимок повреждён: "s + path);
+    }
+    const std::string_view blob = data.substr(blob_offset, blob_size);
+    auto corrupted = [&path] {
+        return SnapshotError("Снимок повреждён: "s + path);
+    };
+
+    auto sheet = std::make_unique<Sheet>();
+    std::vector<Cell*> cells;
+    cells.reserve(cell_count);
+    for (std::uint64_t i = 0; i < cell_count; ++i) {
+        const char* record = data.data() + cells_offset + i * RECORD_SIZE;
+        const Position pos{Get<std::int32_t>(record), Get<std::int32_t>(record + 4)};
+        const auto number = Get<double>(record + 8);
+        const auto text_offset = Get<std::uint64_t>(record + 16);
+        const auto program_offset = Get<std::uint64_t>(record + 24);
+        const auto text_size = Get<std::uint32_t>(record + 32);
+        const auto program_size = Get<std::uint32_t>(record + 36);
+        const auto refs_begin = Get<std::uint32_t>(record + 40);
+        const auto refs_size = Get<std::uint32_t>(record + 44);
+        const auto kind = Get<CellKind>(record + 48);
+        const auto value_kind = Get<ValueKind>(record + 49);
+        const auto category = Get<std::uint8_t>(record + 50);
+        const auto ranges_size = Get<std::uint32_t>(record + 52);
+        const std::uint64_t all_refs_size = refs_size + 2 * std::uint64_t{ranges_size};
+        if (!pos.IsValid() || sheet->FindCell(pos) != nullptr || sheet->numbers_.Find(pos) != nullptr
+            || !fits(text_offset, text_size, 1, blob.size()) || !fits(program_offset, program_size, 1, blob.size())
+            || !fits(refs_begin, all_refs_size, 1, refs_count)) {
+            throw corrupted();
+        }
+        const std::string_view text = blob.substr(text_offset, text_size);
+
+        if (kind == CellKind::NUMBER) {
+            if (ConstantNumber(NumberText(number).View()) != number) throw corrupted();
+            sheet->numbers_.Set(pos, number);
+            continue;
+        }
+
+        auto cell = sheet->NewCell(pos);
+        cell->order_ = ++sheet->last_order_;
+        if (kind == CellKind::TEXT) {
+            cell->impl_.reset(new (sheet->impl_pool_) TextImpl(std::string(text)));
+        } else if (kind == CellKind::FORMULA) {
+            auto read_ref = [&](std::uint64_t ref) -> Position {
+                const char* item = data.data() + refs_offset + (refs_begin + ref) * REF_SIZE;
+                return {Get<std::int32_t>(item), Get<std::int32_t>(item + 4)};
+            };
+            std::vector<Position> precedents(refs_size);
+            for (std::uint32_t ref = 0; ref < refs_size; ++ref) {
+                precedents[ref] = read_ref(ref);
+            }
+            std::vector<Range> ranges(ranges_size);
+            for (std::uint32_t i = 0; i < ranges_size; ++i) {
+                ranges[i] = {read_ref(refs_size + 2 * std::uint64_t{i}), read_ref(refs_size + 2 * std::uint64_t{i} + 1)};
+                if (!ranges[i].first.IsValid() || !ranges[i].last.IsValid()
+                    || !(Range::FromCorners(ranges[i].first, ranges[i].last) == ranges[i])) {
+                    throw corrupted();
+                }
+            }
+            auto out_of_order = std::adjacent_find(precedents.begin(), precedents.end(), [](Position lhs, Position rhs) {
+                return !(lhs < rhs);
+            });
+            if (out_of_order != precedents.end()) throw corrupted();
+            cell->cells_referring_by_me_ = Cell::PositionsSet(precedents.begin(), precedents.end());
+
+            std::optional<FormulaInterface::Value> cache;
+            if (values == SnapshotValues::RESTORE && value_kind == ValueKind::NUMBER) {
+                cache = number;
+            } else if (values == SnapshotValues::RESTORE && value_kind == ValueKind::ERROR) {
+                if (category > static_cast<std::uint8_t>(FormulaError::Category::Arithmetic)) throw corrupted();
+                cache = FormulaError(static_cast<FormulaError::Category>(category));
+            }
+            std::unique_ptr<FormulaInterface> formula;
+            try {
+                formula = RestoreFormula(file, text, blob.substr(program_offset, program_size), std::move(precedents),
+                                         std::move(ranges));
+            } catch (const FormulaException&) {
+                throw corrupted();
+            }
+            cell->impl_.reset(new (sheet->impl_pool_) FormulaImpl(std::move(formula), std::move(cache)));
+        } else if (kind != CellKind::EMPTY) {
+            throw corrupted();
+        }
+        cells.push_back(cell.get());
+        sheet->data_.Set(pos, std::move(cell));
+    }
+
+    // Записи идут в топологическом порядке, поэтому каждая ссылка ведёт
+    // к более ранней ячейке; иначе снимок испорчен и мог бы содержать цикл.
+    for (Cell* cell : cells) {
+        for (Position pos : cell->cells_referring_by_me_) {
+            Cell* precedent = pos.IsValid() ? sheet->FindCell(pos) : nullptr;
+            if (precedent == nullptr || precedent->order_ >= cell->order_) throw corrupted();
+            precedent->cells_referring_me_.Insert(cell->position_);
+        }
+        bool ordered = true;
+        for (const Range& range : cell->GetPrecedentRanges()) {
+            sheet->ForEachCellInRange(range, [&](const Cell& precedent) {
+                ordered = ordered && precedent.order_ < cell->order_;
+            });
+        }
+        if (!ordered) throw corrupted();
+        sheet->AddRangeDependencies(*cell);
+        if (cell->IsStale()) sheet->MarkDirty(*cell);
+    }
+    return sheet;
+}
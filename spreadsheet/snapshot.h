@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+
+// Версия формата снимка листа. Снимки других версий не загружаются:
+// их надо собрать заново из текстов ячеек.
+inline constexpr std::uint32_t SNAPSHOT_VERSION = 3;
+
+class SnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Что делать со значениями формул, сохранёнными в снимке.
+enum class SnapshotValues {
+    RESTORE,
+    RECALCULATE,
+};
@@ -24,6 +24,10 @@ bool Position::IsValid() const {
     return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
 }
 
+Position Position::Shifted(Position offset) const {
+    return {row + offset.row, col + offset.col};
+}
+
 std::string Position::ToString() const {
 
     if (!IsValid()) {
@@ -48,54 +52,59 @@ std::string Position::ConvertColToString(int val) const {
 }
 
 Position Position::FromString(std::string_view str) {
-    Position pos = Position::NONE;
-    std::string num;
-
-    int str_lenght = 0;
-
-    for (char ch : str){
-       if (std::isdigit(static_cast<unsigned char>(ch))){
-           num.push_back(ch);
-       }
-       else{
-           if (num.size() != 0)  return Position::NONE; // Проверка если после букв цифры попадаются тогда дальше обрабатывать нельзя.
-           if (ch >= 'A' && ch <= 'Z'){
-               if (pos.col == -1) pos.col = 0;
-               pos.col *= LETTERS;
-               pos.col += ch - CODE_THE_SYMBOL_BEGIN + 1;
-           }else{
-               return Position::NONE;
-           }
-           ++str_lenght;
-          }
-       }
-    --pos.col;
-    if(MAX_POSITION_LENGTH <= str_lenght){
+    // Разбор без промежуточных строк: сначала буквы столбца, затем цифры строки.
+    // Накопление ограничено сверху, чтобы длинные входные строки не переполняли int.
+    std::size_t letters_count = 0;
+    int col = 0;
+    while (letters_count < str.size() && str[letters_count] >= 'A' && str[letters_count] <= 'Z') {
+        col = std::min(col * LETTERS + (str[letters_count] - CODE_THE_SYMBOL_BEGIN + 1), MAX_COLS + 1);
+        ++letters_count;
+    }
+    if (letters_count == 0 || letters_count == str.size() || letters_count >= MAX_POSITION_LENGTH) {
         return Position::NONE;
     }
 
-    if(num.size() != 0 && MAX_POSITION_LENGTH >= num.size()){
-        int res_num;
-        auto result = std::from_chars(num.data(), num.data() + num.size(), res_num);
-        if (result.ec == std::errc::invalid_argument ||
-                result.ec == std::errc::result_out_of_range)
-            {
-                return Position::NONE;
-            }
-
-        if (res_num > 0){
-            res_num--;
-            pos.row = res_num;
+    std::string_view digits = str.substr(letters_count);
+    if (digits.size() > MAX_POSITION_LENGTH) {
+        return Position::NONE;
+    }
+    int row = 0;
+    for (char ch : digits) {
+        if (!std::isdigit(static_cast<unsigned char>(ch))) {
+            return Position::NONE;
         }
+        row = std::min(row * 10 + (ch - '0'), MAX_ROWS + 1);
     }
 
-    return pos;
+    Position pos{row - 1, col - 1};
+    return pos.IsValid() ? pos : Position::NONE;
 }
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
 
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+}
+
+Range Range::Shifted(Position offset) const {
+    return {first.Shifted(offset), last.Shifted(offset)};
+}
+
+std::string Range::ToString() const {
+    return first.ToString() + ":" + last.ToString();
+}
+
+Range Range::FromCorners(Position lhs, Position rhs) {
+    return {{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+            {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
+
 FormulaError::FormulaError(Category category)
 : category_(category) {}
 
@@ -116,3 +125,25 @@ const std::unordered_map<FormulaError::Category, std::string_view> FormulaError:
         {FormulaError::Category::Value, "#VALUE!"sv},
         {FormulaError::Category::Ref, "#REF!"sv}
 };
+
+std::optional<double> SheetInterface::GetStoredNumber(Position) const {
+    return std::nullopt;
+}
+
+void SheetInterface::GetRangeCells(Range range, std::vector<double>&, std::vector<const CellInterface*>& cells) const {
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            if (const CellInterface* cell = GetCell({row, col})) cells.push_back(cell);
+        }
+    }
+}
+
+void SheetInterface::GetColumnCells(Position top, std::size_t count, double* numbers,
+                                    const CellInterface** cells) const {
+    for (std::size_t k = 0; k < count; ++k) {
+        const Position pos{top.row + static_cast<int>(k), top.col};
+        const std::optional<double> number = GetStoredNumber(pos);
+        numbers[k] = number.value_or(0.0);
+        cells[k] = number ? nullptr : GetCell(pos);
+    }
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Количество занятых ячеек в каждой строке (или столбце) и двухуровневая
+// битовая карта непустых строк: максимальный занятый индекс находится
+// за несколько проверок слов, без обхода всех ячеек.
+class OccupancyCounter {
+public:
+    explicit OccupancyCounter(int size)
+        : counts_(size)
+        , words_((size + BITS - 1) / BITS)
+        , summary_((words_.size() + BITS - 1) / BITS) {
+    }
+
+    void Add(int index) {
+        if (counts_[index]++ == 0) {
+            words_[index / BITS] |= Bit(index % BITS);
+            summary_[index / BITS / BITS] |= Bit(index / BITS % BITS);
+        }
+    }
+
+    void Remove(int index) {
+        if (--counts_[index] == 0) {
+            std::uint64_t& word = words_[index / BITS];
+            word &= ~Bit(index % BITS);
+            if (word == 0) {
+                summary_[index / BITS / BITS] &= ~Bit(index / BITS % BITS);
+            }
+        }
+    }
+
+    // Наибольший индекс с ненулевым счётчиком или -1.
+    int Max() const {
+        for (int i = static_cast<int>(summary_.size()) - 1; i >= 0; --i) {
+            if (summary_[i] != 0) {
+                int word = i * BITS + HighestBit(summary_[i]);
+                return word * BITS + HighestBit(words_[word]);
+            }
+        }
+        return -1;
+    }
+
+private:
+    static constexpr int BITS = 64;
+
+    static std::uint64_t Bit(int index) {
+        return std::uint64_t{1} << index;
+    }
+
+    static int HighestBit(std::uint64_t word) {
+        int bit = 0;
+        for (int shift = BITS / 2; shift > 0; shift /= 2) {
+            if (word >> shift) {
+                word >>= shift;
+                bit += shift;
+            }
+        }
+        return bit;
+    }
+
+    std::vector<std::uint32_t> counts_;
+    std::vector<std::uint64_t> words_;
+    std::vector<std::uint64_t> summary_;
+};
+
+// Разреженная двумерная таблица: лист разбит на плитки TILE_SIZE x TILE_SIZE,
+// память под плитку выделяется при первой записи в неё и освобождается,
+// когда плитка снова становится пустой. Доступ по позиции - два индекса
+// без хеширования, обход идёт по строкам и пропускает пустые плитки.
+// Пустым считается значение T{}, T должен приводиться к bool.
+// Занятость строк и столбцов ведётся при каждой записи и удалении,
+// поэтому размер занятой области известен без обхода ячеек.
+template <typename T>
+class TiledGrid {
+public:
+    static constexpr int TILE_SIZE = 64;
+    static constexpr int TILE_ROWS = (Position::MAX_ROWS + TILE_SIZE - 1) / TILE_SIZE;
+    static constexpr int TILE_COLS = (Position::MAX_COLS + TILE_SIZE - 1) / TILE_SIZE;
+
+    const T& Get(Position pos) const {
+        const Tile* tile = FindTile(pos);
+        return tile != nullptr ? tile->values[SlotIndex(pos)] : EMPTY;
+    }
+
+    void Set(Position pos, T value) {
+        if (!value) {
+            Erase(pos);
+            return;
+        }
+        if (tiles_.empty()) {
+            tiles_.resize(TILE_ROWS * TILE_COLS);
+            band_tiles_.resize(TILE_ROWS);
+            rows_ = std::make_unique<OccupancyCounter>(Position::MAX_ROWS);
+            cols_ = std::make_unique<OccupancyCounter>(Position::MAX_COLS);
+        }
+        auto& tile = tiles_[TileIndex(pos)];
+        if (tile == nullptr) {
+            tile = std::make_unique<Tile>();
+            ++band_tiles_[pos.row / TILE_SIZE];
+        }
+        T& slot = tile->values[SlotIndex(pos)];
+        if (!slot) {
+            ++tile->count;
+            ++size_;
+            rows_->Add(pos.row);
+            cols_->Add(pos.col);
+        }
+        slot = std::move(value);
+    }
+
+    // Возвращает удалённое значение, чтобы вызывающий решал, когда его уничтожить.
+    T Erase(Position pos) {
+        Tile* tile = FindTile(pos);
+        if (tile == nullptr) {
+            return T{};
+        }
+        T& slot = tile->values[SlotIndex(pos)];
+        if (!slot) {
+            return T{};
+        }
+        T value = std::move(slot);
+        slot = T{};
+        --size_;
+        rows_->Remove(pos.row);
+        cols_->Remove(pos.col);
+        if (--tile->count == 0) {
+            tiles_[TileIndex(pos)].reset();
+            --band_tiles_[pos.row / TILE_SIZE];
+        }
+        return value;
+    }
+
+    std::size_t Count() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // Размер минимального прямоугольника от A1, содержащего все значения.
+    Size Extent() const {
+        if (Empty()) {
+            return {0, 0};
+        }
+        return {rows_->Max() + 1, cols_->Max() + 1};
+    }
+
+    // Вызывает func(Position, const T&) для всех непустых значений
+    // в порядке строк, а внутри строки - в порядке столбцов.
+    template <typename Func>
+    void ForEach(Func func) const {
+        std::vector<const Tile*> band;
+        std::vector<int> band_cols;
+        for (int tile_row = 0; tile_row < static_cast<int>(band_tiles_.size()); ++tile_row) {
+            if (band_tiles_[tile_row] == 0) {
+                continue;
+            }
+            band.clear();
+            band_cols.clear();
+            for (int tile_col = 0; tile_col < TILE_COLS; ++tile_col) {
+                if (const Tile* tile = tiles_[tile_row * TILE_COLS + tile_col].get()) {
+                    band.push_back(tile);
+                    band_cols.push_back(tile_col);
+                }
+            }
+            for (int row_in_tile = 0; row_in_tile < TILE_SIZE; ++row_in_tile) {
+                for (std::size_t i = 0; i < band.size(); ++i) {
+                    const T* values = &band[i]->values[row_in_tile * TILE_SIZE];
+                    for (int col_in_tile = 0; col_in_tile < TILE_SIZE; ++col_in_tile) {
+                        if (values[col_in_tile]) {
+                            func(Position{tile_row * TILE_SIZE + row_in_tile, band_cols[i] * TILE_SIZE + col_in_tile},
+                                 values[col_in_tile]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Вызывает func(Position, const T&) для непустых значений внутри range.
+    // Пропускает невыделенные плитки, порядок обхода - по плиткам.
+    template <typename Func>
+    void ForEachInRange(Range range, Func func) const {
+        if (tiles_.empty()) {
+            return;
+        }
+        for (int tile_row = range.first.row / TILE_SIZE; tile_row <= range.last.row / TILE_SIZE; ++tile_row) {
+            if (band_tiles_[tile_row] == 0) {
+                continue;
+            }
+            const int row_begin = std::max(range.first.row, tile_row * TILE_SIZE);
+            const int row_end = std::min(range.last.row, tile_row * TILE_SIZE + TILE_SIZE - 1);
+            for (int tile_col = range.first.col / TILE_SIZE; tile_col <= range.last.col / TILE_SIZE; ++tile_col) {
+                const Tile* tile = tiles_[tile_row * TILE_COLS + tile_col].get();
+                if (tile == nullptr) {
+                    continue;
+                }
+                const int col_begin = std::max(range.first.col, tile_col * TILE_SIZE);
+                const int col_end = std::min(range.last.col, tile_col * TILE_SIZE + TILE_SIZE - 1);
+                for (int row = row_begin; row <= row_end; ++row) {
+                    for (int col = col_begin; col <= col_end; ++col) {
+                        const T& value = tile->values[SlotIndex({row, col})];
+                        if (value) {
+                            func(Position{row, col}, value);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    struct Tile {
+        std::array<T, TILE_SIZE * TILE_SIZE> values{};
+        int count = 0;
+    };
+
+    static std::size_t TileIndex(Position pos) {
+        return static_cast<std::size_t>(pos.row / TILE_SIZE) * TILE_COLS + pos.col / TILE_SIZE;
+    }
+
+    static std::size_t SlotIndex(Position pos) {
+        return static_cast<std::size_t>(pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+    }
+
+    Tile* FindTile(Position pos) const {
+        return tiles_.empty() ? nullptr : tiles_[TileIndex(pos)].get();
+    }
+
+    static inline const T EMPTY{};
+
+    std::vector<std::unique_ptr<Tile>> tiles_;
+    // Количество выделенных плиток в каждой полосе из TILE_SIZE строк.
+    std::vector<int> band_tiles_;
+    std::unique_ptr<OccupancyCounter> rows_;
+    std::unique_ptr<OccupancyCounter> cols_;
+    std::size_t size_ = 0;
+};